@@ -0,0 +1,870 @@
+#define XML_H_IMPLEMENTATION
+#include "xml.h"
+
+#include <fcntl.h>
+#include <locale.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+// Tests of functions added in 2.2. Run with `make test` (builds with sanitizers and as C++).
+
+static int failures = 0;
+
+#define CHECK(cond)                                                                                                    \
+  do {                                                                                                                 \
+    if (!(cond)) {                                                                                                     \
+      fprintf(stderr, "%s:%d: check failed: %s\n", __FILE__, __LINE__, #cond);                                        \
+      failures++;                                                                                                      \
+    }                                                                                                                  \
+  } while (0)
+
+#define CHECK_STR(actual, expected) CHECK((actual) && strcmp((actual), (expected)) == 0)
+
+// Serialize node into a new string. Free with `free()`.
+static char *serialize(XMLNode *node) {
+  XMLString *str = xml_string_new();
+  xml_node_serialize(node, str);
+  return xml_string_steal(str);
+}
+
+// ---------- Compaction ---------- //
+
+static void test_compact() {
+  XMLNode *doc = xml_parse_string("<r a=\"1\"><b>text</b><c x=\"y\"/></r>");
+  char *before = serialize(doc);
+  doc = xml_node_compact(doc);
+  CHECK(doc);
+  char *after = serialize(doc);
+  CHECK(before && after && strcmp(before, after) == 0);
+  // Compacted tree can be edited
+  xml_node_add_attr(xml_node_find_tag(doc, "b", true), "k", "v");
+  xml_node_new(xml_node_find_tag(doc, "c", true), "d", NULL);
+  char *edited = serialize(doc);
+  CHECK(edited && strstr(edited, "<b k=\"v\">text</b><c x=\"y\"><d/></c>"));
+  free(before);
+  free(after);
+  free(edited);
+  xml_node_free(doc);
+}
+
+// ---------- XMLDocument ---------- //
+
+#define READERS 4
+#define VERSIONS 300
+
+typedef struct {
+  XMLDocumentSlot *slot;
+  size_t done;
+  size_t reads;
+} PublishTest;
+
+// Every version has `n` items with ids 0..n-1 and `version="n"` on the root.
+static XMLDocument *make_version(size_t n) {
+  XMLNode *root = xml_node_new(NULL, "root", NULL);
+  xml_node_add_attr_uint64(root, "version", n);
+  for (size_t i = 0; i < n; i++) xml_node_add_attr_uint64(xml_node_new(root, "item", NULL), "id", i);
+  XMLNode *doc = xml_node_new(NULL, NULL, NULL);
+  xml_node_append_children(doc, &root, 1);
+  XMLDocument *document = xml_document_freeze(doc);
+  CHECK(document && xml_document_index_attr(document, "id"));
+  return document;
+}
+
+static void *read_versions(void *arg) {
+  PublishTest *test = (PublishTest *)arg;
+  size_t reads = 0;
+  while (!XML__ATOMIC_LOAD(&test->done)) {
+    XMLDocument *doc = xml_document_acquire(test->slot);
+    if (!doc) continue;
+    XMLNode *root = xml_node_find_tag(doc->root, "root", true);
+    size_t n = strtoull(xml_node_attr(root, "version"), NULL, 10);
+    CHECK(root->children->len == n);
+    CHECK(xml_node_find_tag(doc->root, "root/item", true) || n == 0);
+    char id[24];
+    snprintf(id, sizeof(id), "%zu", n ? n - 1 : 0);
+    CHECK(n == 0 || xml_document_lookup(doc, "id", id) == xml_node_child_at(root, n - 1));
+    xml_document_release(doc);
+    reads++;
+  }
+  XML__ATOMIC_ADD(&test->reads, reads);
+  return NULL;
+}
+
+static void test_documents() {
+  XMLDocument *doc = make_version(2);
+  CHECK(xml_document_retain(doc) == doc && doc->refs == 2);
+  xml_document_release(doc);
+  CHECK(!xml_document_freeze(xml_node_child_at(doc->root, 0))); // Has a parent
+  XMLDocumentSlot slot = {0};
+  CHECK(!xml_document_acquire(&slot));
+  xml_document_publish(&slot, doc);
+  XMLDocument *held = xml_document_acquire(&slot);
+  CHECK(held == doc);
+  xml_document_publish(&slot, make_version(3));
+  // Held document stays alive after it's replaced
+  CHECK(xml_node_child_at(xml_node_child_at(held->root, 0), 1) != NULL);
+  xml_document_release(held);
+
+  // Readers racing with a publisher
+  PublishTest test = {&slot, 0, 0};
+  pthread_t readers[READERS];
+  for (int i = 0; i < READERS; i++) CHECK(pthread_create(&readers[i], NULL, read_versions, &test) == 0);
+  for (size_t v = 0; v < VERSIONS; v++) xml_document_publish(&slot, make_version(v % 17));
+  XML__ATOMIC_STORE(&test.done, 1);
+  for (int i = 0; i < READERS; i++) pthread_join(readers[i], NULL);
+  xml_document_publish(&slot, NULL);
+  CHECK(slot.current == NULL);
+}
+
+// ---------- Background freeing ---------- //
+
+static void test_free_async() {
+  for (int i = 0; i < 100; i++) xml_node_free_async(xml_parse_string("<r><a/><b>text</b></r>"));
+  xml_node_free_async(xml_node_compact(xml_parse_string("<r/>")));
+  // Nodes with a parent are rejected
+  XMLNode *doc = xml_parse_string("<r><a/></r>");
+  XMLNode *r = xml_node_child_at(doc, 0);
+  CHECK(!xml_node_free_async(r));
+  CHECK(r->parent == doc && xml_node_child_at(doc, 0) == r);
+  xml_node_free_wait();
+  CHECK(xml_node_free_async(doc));
+  // Shutdown frees everything queued, the thread starts again on the next call
+  for (int i = 0; i < 100; i++) xml_node_free_async(xml_parse_string("<r><a/><b>text</b></r>"));
+  xml_node_free_shutdown();
+  xml_node_free_shutdown();
+  CHECK(xml_node_free_async(xml_parse_string("<r><a/></r>")));
+  xml_node_free_shutdown();
+}
+
+// ---------- XMLAllocator ---------- //
+
+typedef struct {
+  size_t live; // Number of live blocks
+} CountingAllocator;
+
+static void *counting_calloc(void *user_data, size_t count, size_t size) {
+  void *ptr = calloc(count, size);
+  if (ptr) ((CountingAllocator *)user_data)->live++;
+  return ptr;
+}
+
+static void *counting_realloc(void *user_data, void *ptr, size_t size) {
+  void *result = realloc(ptr, size);
+  if (!ptr && result) ((CountingAllocator *)user_data)->live++;
+  return result;
+}
+
+static void counting_free(void *user_data, void *ptr) {
+  if (ptr) ((CountingAllocator *)user_data)->live--;
+  free(ptr);
+}
+
+static void test_allocator() {
+  CountingAllocator counter = {0};
+  XMLAllocator allocator = {counting_calloc, counting_realloc, counting_free, &counter};
+  XMLNode *root = xml_parse_string_with_allocator("<a x=\"1\"><b>text</b></a>", &allocator);
+  CHECK(counter.live > 0);
+  XMLNode *child = xml_node_new_with_allocator(xml_node_child_at(root, 0), "c", NULL, NULL);
+  CHECK(child && child->allocator == &allocator);
+  xml_node_free(root);
+  XMLString *str = xml_string_new_with_allocator(&allocator);
+  xml_string_append(str, "abc");
+  xml_string_free(str);
+  XMLList *list = xml_list_new_with_allocator(&allocator);
+  xml_list_add(list, &counter);
+  CHECK(list->len == 1);
+  XML_FREE(&allocator, list->data);
+  XML_FREE(&allocator, list);
+  CHECK(counter.live == 0);
+}
+
+static void test_parse_file() {
+  const char *path = "xml_test_file.xml";
+  FILE *file = fopen(path, "w");
+  CHECK(file);
+  if (!file) return;
+  fputs("<a><b>1</b></a>", file);
+  fclose(file);
+  CountingAllocator counter = {0};
+  XMLAllocator allocator = {counting_calloc, counting_realloc, counting_free, &counter};
+  XMLNode *root = xml_parse_file_with_allocator(path, &allocator);
+  CHECK_STR(xml_node_find_tag(root, "a/b", true)->text, "1");
+  xml_node_free(root);
+  CHECK(counter.live == 0);
+  remove(path);
+}
+
+// ---------- Pool allocator ---------- //
+
+static void *free_in_thread(void *arg) {
+  xml_node_free((XMLNode *)arg);
+  return NULL;
+}
+
+static void *free_and_flush(void *arg) {
+  xml_node_free((XMLNode *)arg);
+  CHECK(xml__pool_local->batch_len > 0);
+  xml_pool_flush();
+  CHECK(xml__pool_local->batch_len == 0);
+  return NULL;
+}
+
+static void test_pool_allocator() {
+  const XMLAllocator *pool = xml_pool_allocator();
+  for (int round = 0; round < 3; round++) {
+    XMLNode *doc = xml_parse_string_with_allocator("<r><a x=\"1\">t</a><b/></r>", pool);
+    CHECK(doc && doc->allocator == pool);
+    CHECK_STR(xml_node_find_tag(doc, "r/a", true)->text, "t");
+    // Blocks freed by another thread go back to this one
+    pthread_t thread;
+    CHECK(pthread_create(&thread, NULL, free_in_thread, doc) == 0);
+    pthread_join(thread, NULL);
+  }
+  // Partial batch is returned by a thread that keeps running
+  pthread_t thread_flush;
+  XMLNode *doc = xml_parse_string_with_allocator("<r><a/></r>", pool);
+  CHECK(pthread_create(&thread_flush, NULL, free_and_flush, doc) == 0);
+  pthread_join(thread_flush, NULL);
+}
+
+// ---------- Borrowed and transferred strings ---------- //
+
+static void test_string_modes() {
+  XMLNode *root = xml_node_new_static(NULL, "root", NULL);
+  xml_node_add_attr_static(root, "s", "static");
+  char *key = (char *)XML_CALLOC_FUNC(2, 1), *value = (char *)XML_CALLOC_FUNC(2, 1);
+  key[0] = 't';
+  value[0] = 'v';
+  xml_node_add_attr_take(root, key, value);
+  xml_node_add_attr_ex(root, "e", XML_STR_COPY, "copy", XML_STR_COPY);
+  // Taken strings are freed when the attribute can't be added
+  key = (char *)XML_CALLOC_FUNC(2, 1);
+  xml_node_add_attr_take(root, key, NULL);
+  CHECK(root->attrs->len == 3);
+  CHECK_STR(xml_node_attr(root, "s"), "static");
+  CHECK_STR(xml_node_attr(root, "t"), "v");
+  CHECK_STR(xml_node_attr(root, "e"), "copy");
+  XMLNode *a = xml_node_new_ex(root, "a", XML_STR_STATIC, "x", XML_STR_COPY);
+  CHECK_STR(a->tag, "a");
+  CHECK_STR(a->text, "x");
+  char *out = serialize(root);
+  CHECK_STR(out, "<root s=\"static\" t=\"v\" e=\"copy\"><a>x</a></root>");
+  free(out);
+  xml_node_free(root);
+}
+
+// ---------- Bulk construction ---------- //
+
+static void test_bulk() {
+  XMLNode *root = xml_node_new(NULL, "root", NULL);
+  xml_node_reserve_attrs(root, 8);
+  xml_node_reserve_children(root, 8);
+  CHECK(root->attrs->size >= 8 && root->children->size >= 8);
+  const char *keys[] = {"k1", "k2"};
+  const char *values[] = {"v1", "v2"};
+  xml_node_add_attrs(root, keys, values, 2);
+  CHECK(root->attrs->len == 2);
+  CHECK_STR(xml_node_attr(root, "k2"), "v2");
+  XMLNode *nodes[2] = {xml_node_new(NULL, "b", "1"), xml_node_new(NULL, "c", "2")};
+  CHECK(xml_node_append_children(root, nodes, 2) == 2);
+  CHECK(root->children->len == 2 && nodes[1]->parent == root);
+  // Nodes with a parent, repeated nodes and the tree's own root are skipped
+  XMLNode *again[4] = {nodes[0], root, NULL, nodes[1]};
+  CHECK(xml_node_append_children(nodes[0], again, 4) == 0);
+  CHECK(root->children->len == 2 && nodes[0]->children->len == 0);
+  char *out = serialize(root);
+  CHECK_STR(out, "<root k1=\"v1\" k2=\"v2\"><b>1</b><c>2</c></root>");
+  free(out);
+  XMLNode *d = xml_node_new(NULL, "d", NULL);
+  XMLNode *twice[2] = {d, d};
+  CHECK(xml_node_append_children(root, twice, 2) == 1 && root->children->len == 3);
+  XMLList *list = xml_list_new();
+  xml_list_reserve(list, 100);
+  CHECK(list->size >= 100 && list->len == 0);
+  XML_FREE_FUNC(list->data);
+  XML_FREE_FUNC(list);
+  xml_node_free(root);
+}
+
+// ---------- Cloning ---------- //
+
+static void test_clone() {
+  XMLNode *doc = xml_parse_string("<r a=\"1\"><b>text</b><c x=\"y\"/></r>");
+  char *expected = serialize(doc);
+  XMLNode *copy = xml_node_clone(xml_node_child_at(doc, 0));
+  CHECK(copy && copy->parent == NULL);
+  char *cloned = serialize(copy);
+  CHECK_STR(cloned, expected);
+  // Clone is independent of the original and can be edited
+  xml_node_free(doc);
+  xml_node_new(copy, "d", "new");
+  char *edited = serialize(copy);
+  CHECK(edited && strstr(edited, "<d>new</d></r>"));
+  free(expected);
+  free(cloned);
+  free(edited);
+  xml_node_free(copy);
+}
+
+// ---------- XMLTemplate ---------- //
+
+static void test_template() {
+  XMLTemplate *tmpl = xml_template_compile("<a id=\"{id}\">{name}{{x}}</a>");
+  CHECK(tmpl && tmpl->names_len == 2);
+  if (!tmpl) return;
+  const char *values[2];
+  values[xml_template_index(tmpl, "id")] = "1";
+  values[xml_template_index(tmpl, "name")] = "<b>";
+  CHECK(xml_template_index(tmpl, "other") == (size_t)-1);
+  XMLString *str = xml_string_new();
+  xml_template_render(tmpl, values, str);
+  CHECK_STR(str->str, "<a id=\"1\">&lt;b&gt;{x}</a>");
+  xml_string_free(str);
+  xml_template_free(tmpl);
+  CHECK(!xml_template_compile("<a>{open</a>"));
+}
+
+// ---------- Columnar emitter ---------- //
+
+static void test_columns() {
+  const char *names[] = {"a", NULL};
+  int64_t ids[] = {1, -2};
+  double scores[] = {0.5, 2};
+  bool flags[] = {true, false};
+  XMLColumn columns[] = {
+      {"id", XML_COLUMN_INT64, false, ids},
+      {"name", XML_COLUMN_STRING, false, names},
+      {"ok", XML_COLUMN_BOOL, false, flags},
+      {"score", XML_COLUMN_DOUBLE, true, scores},
+  };
+  XMLString *str = xml_string_new();
+  xml_emit_columns(str, "row", columns, 4, 2);
+  CHECK_STR(str->str, "<row id=\"1\" name=\"a\" ok=\"true\"><score>0.5</score></row>"
+                      "<row id=\"-2\" ok=\"false\"><score>2</score></row>");
+  xml_string_free(str);
+}
+
+// ---------- Number setters ---------- //
+
+static void test_numbers() {
+  XMLString *str = xml_string_new();
+  xml_string_append_int64(str, -42);
+  xml_string_append(str, " ");
+  xml_string_append_uint64(str, 18446744073709551615ull);
+  xml_string_append(str, " ");
+  xml_string_append_double(str, 0.1);
+  xml_string_append(str, " ");
+  xml_string_append_double(str, 1.0 / 0.0);
+  CHECK_STR(str->str, "-42 18446744073709551615 0.1 INF");
+  // Shortest digits that read back as the same value, also for subnormals
+  const double doubles[] = {5e-324, 2.2250738585072014e-308, 1.7976931348623157e308, 0.30000000000000004, 1e21, 1e-7,
+                            -123.456, 9.5367431640625e-7};
+  const char *expected = "5e-324 2.2250738585072014e-308 1.7976931348623157e+308 0.30000000000000004 1e+21 1e-7 "
+                         "-123.456 9.5367431640625e-7 ";
+  xml_string_clear(str);
+  for (size_t i = 0; i < sizeof(doubles) / sizeof(doubles[0]); i++) {
+    xml_string_append_double(str, doubles[i]);
+    xml_string_append(str, " ");
+  }
+  CHECK_STR(str->str, expected);
+  for (size_t i = 0; i < sizeof(doubles) / sizeof(doubles[0]); i++) {
+    xml_string_clear(str);
+    xml_string_append_double(str, doubles[i]);
+    CHECK(strtod(str->str, NULL) == doubles[i]);
+  }
+  // Locale doesn't change the decimal point
+  if (setlocale(LC_NUMERIC, "de_DE.UTF-8") || setlocale(LC_NUMERIC, "fr_FR.UTF-8")) {
+    xml_string_clear(str);
+    xml_string_append_double(str, 0.5);
+    xml_string_append_double(str, 1.0 / 3);
+    setlocale(LC_NUMERIC, "C");
+    CHECK_STR(str->str, "0.50.3333333333333333");
+  }
+  xml_string_free(str);
+  XMLNode *root = xml_node_new(NULL, "root", NULL);
+  xml_node_add_attr_int64(root, "i", -7);
+  xml_node_add_attr_uint64(root, "u", 7);
+  xml_node_add_attr_double(root, "d", 2.5);
+  CHECK_STR(xml_node_attr(root, "i"), "-7");
+  CHECK_STR(xml_node_attr(root, "u"), "7");
+  CHECK_STR(xml_node_attr(root, "d"), "2.5");
+  XMLNode *a = xml_node_new(root, "a", NULL);
+  xml_node_set_text(a, "y");
+  CHECK_STR(a->text, "y");
+  xml_node_set_text_int64(a, -1);
+  CHECK_STR(a->text, "-1");
+  xml_node_set_text_uint64(a, 1);
+  CHECK_STR(a->text, "1");
+  xml_node_set_text_double(a, 0.5);
+  CHECK_STR(a->text, "0.5");
+  xml_node_set_text(a, NULL);
+  CHECK(a->text == NULL);
+  xml_node_free(root);
+}
+
+// ---------- String buffers ---------- //
+
+static void test_string_buffers() {
+  XMLString *str = xml_string_new();
+  xml_string_append_n(str, "abcdef", 3);
+  xml_string_append_escaped(str, "<&\"'>");
+  CHECK_STR(str->str, "abc&lt;&amp;&quot;&apos;&gt;");
+  xml_string_clear(str);
+  CHECK(str->len == 0 && str->str[0] == '\0');
+  xml_string_reserve(str, 4096);
+  CHECK(str->size >= 4096);
+  xml_string_reset(str, 64);
+  CHECK(str->len == 0 && str->size <= 64);
+  xml_string_free(str);
+  // Pooled strings
+  XMLString *pooled = xml_string_acquire();
+  CHECK(pooled && pooled->len == 0);
+  xml_string_append(pooled, "reused");
+  xml_string_release(pooled);
+  pooled = xml_string_acquire();
+  CHECK(pooled && pooled->len == 0);
+  xml_string_release(pooled);
+}
+
+// ---------- Vectored output ---------- //
+
+static void test_iov_sink() {
+  char path[] = "xml_test_iov_XXXXXX";
+  int fd = mkstemp(path);
+  CHECK(fd >= 0);
+  if (fd < 0) return;
+  XMLNode *doc = xml_parse_string("<r a=\"1\"><b>text</b><c/></r>");
+  XMLIovSink sink;
+  xml_iov_sink_init(&sink, fd);
+  CHECK(xml_node_serialize_iov(doc, &sink));
+  CHECK(xml_iov_sink_flush(&sink) && !sink.error);
+  char *expected = serialize(doc);
+  char buf[256] = {0};
+  lseek(fd, 0, SEEK_SET);
+  ssize_t len = read(fd, buf, sizeof(buf) - 1);
+  CHECK(len > 0 && (size_t)len == sink.written && strcmp(buf, expected) == 0);
+  free(expected);
+  close(fd);
+  remove(path);
+  xml_node_free(doc);
+}
+
+// ---------- Tag filters ---------- //
+
+static void test_tag_filters() {
+  XMLNode *doc = xml_parse_string("<r><a/></r>");
+  XMLNode *a = xml_node_find_tag(doc, "a", true);
+  // Builder functions keep filters up to date
+  XMLNode *y = xml_node_new(a, "y", NULL);
+  CHECK(xml_node_find_tag(doc, "y", true) == y);
+  CHECK(!xml_node_find_tag(doc, "w", true));
+  // Direct edits need them recomputed
+  XMLNode *z = xml_node_new(NULL, "z", NULL);
+  xml_list_add(a->children, z);
+  z->parent = a;
+  xml_node_update_tag_filters(doc);
+  CHECK(xml_node_find_tag(doc, "z", true) == z);
+  XMLQueryCache *cache = xml_query_cache_new();
+  XMLQuery *query = xml_query_compile("//z");
+  const XMLNodeSet *set = xml_query_eval(query, doc, cache);
+  CHECK(set && set->len == 1 && set->nodes[0] == z);
+  xml_query_free(query);
+  xml_query_cache_free(cache);
+  XMLDocument *frozen = xml_document_freeze(doc);
+  CHECK(frozen);
+  CHECK(xml_node_find_tag(frozen->root, "z", true));
+  CHECK(xml_node_find_tag(frozen->root, "r/a/z", true));
+  CHECK(!xml_node_find_tag(frozen->root, "w", true));
+  xml_document_release(frozen);
+}
+
+// ---------- Order numbering ---------- //
+
+static void test_order() {
+  XMLNode *doc = xml_parse_string("<r><a><b/><c/></a><d/></r>");
+  XMLNode *r = xml_node_find_tag(doc, "r", true);
+  XMLNode *a = xml_node_find_tag(doc, "a", true), *c = xml_node_find_tag(doc, "c", true);
+  XMLNode *d = xml_node_find_tag(doc, "d", true);
+  CHECK(xml_node_is_ancestor(r, c) && xml_node_is_ancestor(a, c) && !xml_node_is_ancestor(c, a));
+  CHECK(xml_node_compare_order(a, d) < 0 && xml_node_compare_order(d, c) > 0 && xml_node_compare_order(d, d) == 0);
+  CHECK(xml_node_descendants_count(r) == 4);
+  // Edits invalidate numbering and queries renumber
+  XMLNode *e = xml_node_new(c, "e", NULL);
+  CHECK(xml_node_descendants_count(r) == 5);
+  CHECK(xml_node_compare_order(e, d) < 0);
+  xml_node_update_order(e);
+  CHECK(xml_node_is_ancestor(a, e));
+  // Nodes of different trees are unordered and don't renumber a frozen tree
+  XMLDocument *frozen = xml_document_freeze(xml_parse_string("<r><a/></r>"));
+  XMLNode *fa = xml_node_find_tag(frozen->root, "a", true);
+  size_t stamp = fa->order_stamp;
+  CHECK(xml_node_compare_order(fa, e) == 0 && xml_node_compare_order(e, fa) == 0);
+  CHECK(!xml_node_is_ancestor(frozen->root, e) && !xml_node_is_ancestor(r, fa));
+  CHECK(fa->order_stamp == stamp && frozen->root->order_stamp == stamp);
+  xml_document_release(frozen);
+  xml_node_free(doc);
+}
+
+// ---------- Attribute index ---------- //
+
+static void test_attr_index() {
+  XMLNode *doc = xml_parse_string("<r><i id=\"1\"/><i id=\"2\"><i id=\"3\"/></i></r>");
+  CHECK(xml_node_index_attr(doc, "id"));
+  XMLNode *three = xml_node_lookup(doc, "id", "3");
+  CHECK(three && three->parent && strcmp(xml_node_attr(three->parent, "id"), "2") == 0);
+  CHECK(!xml_node_lookup(doc, "id", "4"));
+  XMLNode *four = xml_node_new(three, "i", NULL);
+  xml_node_add_attr(four, "id", "4");
+  CHECK(xml_node_lookup(doc, "id", "4") == four);
+  XMLNode *added = xml_node_new(NULL, "i", NULL);
+  xml_node_add_attr(added, "id", "5");
+  xml_node_append_children(xml_node_child_at(doc, 0), &added, 1);
+  CHECK(xml_node_lookup(doc, "id", "5") == added);
+  // Duplicates added later don't replace the indexed node
+  XMLNode *first = xml_node_lookup(doc, "id", "1");
+  xml_node_add_attr(xml_node_new(xml_node_child_at(doc, 0), "i", NULL), "id", "1");
+  CHECK(xml_node_lookup(doc, "id", "1") == first);
+  // Lookups work from any node of the tree
+  CHECK(xml_node_lookup(four, "id", "3") == three);
+  // Index survives compaction
+  doc = xml_node_compact(doc);
+  CHECK(doc && xml_node_lookup(doc, "id", "5"));
+  CHECK(!xml_node_lookup(doc, "other", "1"));
+  xml_node_free(doc);
+}
+
+// ---------- Children index ---------- //
+
+static void test_children_index() {
+  XMLNode *root = xml_node_new(NULL, "r", NULL);
+  for (int i = 0; i < 40; i++) xml_node_new(root, i % 3 ? "a" : "b", NULL);
+  CHECK(xml_node_child_by_tag(root, "b") == xml_node_child_at(root, 0));
+  CHECK(xml_node_child_by_tag(root, "a") == xml_node_child_at(root, 1));
+  CHECK(!xml_node_child_by_tag(root, "c"));
+  xml_node_new(root, "c", NULL);
+  CHECK(xml_node_child_by_tag(root, "c") == xml_node_child_at(root, 40));
+  size_t iter = 0, count = 0;
+  for (XMLNode *child; (child = xml_node_children_by_tag(root, "b", &iter));) count++;
+  CHECK(count == 14);
+  xml_node_free(root);
+}
+
+// ---------- Sorted index ---------- //
+
+static void test_sorted_index() {
+  XMLNode *doc = xml_parse_string("<r><p v=\"3\" n=\"c\"/><p v=\"1\" n=\"a\"/><p v=\"x\" n=\"d\"/><q v=\"2\"/>"
+                                  "<p v=\"2\" n=\"b\"/></r>");
+  XMLNode *r = xml_node_child_at(doc, 0);
+  XMLSortedIndex *numeric = xml_node_build_sorted_index(r, "p", "v", XML_NUMERIC);
+  CHECK(numeric && numeric->len == 3);
+  size_t len = 0;
+  XMLNode **span = xml_sorted_index_range(numeric, 2, 3, &len);
+  CHECK(len == 2 && span && strcmp(xml_node_attr(span[0], "v"), "2") == 0);
+  xml_sorted_index_free(numeric);
+  XMLSortedIndex *lexical = xml_node_build_sorted_index(r, NULL, "n", XML_LEXICAL);
+  CHECK(lexical && lexical->len == 4);
+  span = xml_sorted_index_range_str(lexical, "b", NULL, &len);
+  CHECK(len == 3 && strcmp(xml_node_attr(span[0], "n"), "b") == 0);
+  xml_sorted_index_free(lexical);
+  xml_node_free(doc);
+}
+
+// ---------- Streaming path matching ---------- //
+
+static bool count_element(const char *element, size_t len, void *user_data) {
+  XMLNode *doc = xml_parse_string_n(element, len);
+  CHECK(doc && xml_node_child_at(doc, 0) && strcmp(xml_node_child_at(doc, 0)->tag, "item") == 0);
+  xml_node_free(doc);
+  (*(size_t *)user_data)++;
+  return true;
+}
+
+static void test_stream() {
+  const char *data = "<feed><item id=\"1\"><item id=\"2\"/></item><other/><item/></feed>";
+  size_t count = 0;
+  CHECK(xml_stream_match(data, strlen(data), "item", count_element, &count) == 3 && count == 3);
+  count = 0;
+  CHECK(xml_stream_match(data, strlen(data), "feed/item", count_element, &count) == 2);
+  // Truncated input
+  XMLNode *doc = xml_parse_string_n(data, 20);
+  CHECK(doc);
+  xml_node_free(doc);
+}
+
+// ---------- XMLQuerySet ---------- //
+
+static bool count_query_node(size_t query_id, XMLNode *node, void *user_data) {
+  (void)node;
+  ((size_t *)user_data)[query_id]++;
+  return true;
+}
+
+static bool count_query_stream(size_t query_id, const char *element, size_t len, void *user_data) {
+  (void)element;
+  (void)len;
+  ((size_t *)user_data)[query_id]++;
+  return true;
+}
+
+static void test_query_set() {
+  XMLQuerySet *set = xml_query_set_new();
+  CHECK(xml_query_set_add(set, "r/a/b") == 0);
+  CHECK(xml_query_set_add(set, "r/a") == 1);
+  CHECK(xml_query_set_add(set, "b") == 2);
+  CHECK(xml_query_set_add(set, "") == (size_t)-1);
+  const char *data = "<r><a><b/><b/></a><c><b/></c></r>";
+  size_t counts[3] = {0};
+  XMLNode *doc = xml_parse_string(data);
+  CHECK(xml_query_set_match_node(set, doc, count_query_node, counts) == 6);
+  CHECK(counts[0] == 2 && counts[1] == 1 && counts[2] == 3);
+  memset(counts, 0, sizeof(counts));
+  CHECK(xml_query_set_match_stream(set, data, strlen(data), count_query_stream, counts) == 6);
+  CHECK(counts[0] == 2 && counts[1] == 1 && counts[2] == 3);
+  xml_node_free(doc);
+  xml_query_set_free(set);
+}
+
+// ---------- Streaming aggregation ---------- //
+
+static void test_aggregate() {
+  const char *data = "<log><e v=\"1\">5</e><e v=\"x\"><n>a</n>7</e><e v=\"3\"/><f v=\"100\"/></log>";
+  XMLAggregate result;
+  CHECK(xml_aggregate(data, strlen(data), "log/e", "v", XML_AGG_SUM | XML_AGG_MIN | XML_AGG_MAX, &result));
+  CHECK(result.count == 3 && result.values == 2 && result.sum == 4 && result.min == 1 && result.max == 3);
+  CHECK(xml_aggregate(data, strlen(data), "e", NULL, XML_AGG_SUM, &result));
+  CHECK(result.count == 3 && result.values == 2 && result.sum == 12 && result.max == 0);
+  CHECK(!xml_aggregate(data, strlen(data), "", NULL, XML_AGG_COUNT, &result));
+}
+
+// ---------- Text search ---------- //
+
+static void test_find_text() {
+  for (int compact = 0; compact < 2; compact++) {
+    XMLNode *doc = xml_parse_string("<r><a>Error one</a><b>ok</b><c>another error</c></r>");
+    if (compact) doc = xml_node_compact(doc);
+    XMLTextIter iter = {0};
+    size_t count = 0;
+    for (XMLNode *node; (node = xml_node_find_text(doc, "error", 0, &iter));) count++;
+    CHECK(count == 1);
+    CHECK(!xml_node_find_text(doc, "error", 0, &iter)); // End is sticky
+    xml_text_iter_free(&iter);
+    count = 0;
+    for (XMLNode *node; (node = xml_node_find_text(doc, "error", XML_FIND_TEXT_IGNORE_CASE, &iter));) count++;
+    CHECK(count == 2);
+    // Stopped early
+    XMLTextIter stopped = {0};
+    CHECK(xml_node_find_text(doc, "o", 0, &stopped));
+    xml_text_iter_free(&stopped);
+    xml_node_free(doc);
+  }
+}
+
+static void *find_text_shared(void *arg) {
+  XMLDocument *doc = (XMLDocument *)arg;
+  for (int i = 0; i < 200; i++) {
+    XMLTextIter iter = {0};
+    CHECK(xml_node_find_text(doc->root, "x", 0, &iter));
+    xml_text_iter_free(&iter);
+  }
+  return NULL;
+}
+
+// Readers search text of a shared document while another one builds a children index in it
+static void test_find_text_shared() {
+  XMLString *str = xml_string_new();
+  xml_string_append(str, "<r>");
+  for (int i = 0; i < 32; i++) xml_string_append(str, "<i>x</i>");
+  xml_string_append(str, "</r>");
+  XMLDocument *doc = xml_document_freeze(xml_parse_string(str->str));
+  xml_string_free(str);
+  pthread_t threads[2];
+  for (int i = 0; i < 2; i++) CHECK(pthread_create(&threads[i], NULL, find_text_shared, doc) == 0);
+  CHECK(xml_node_child_by_tag(xml_node_child_at(doc->root, 0), "i"));
+  for (int i = 0; i < 2; i++) pthread_join(threads[i], NULL);
+  xml_document_release(doc);
+}
+
+// ---------- XMLQuery ---------- //
+
+static size_t query_len(XMLQueryCache *cache, XMLNode *node, const char *expr) {
+  XMLQuery *query = xml_query_compile(expr);
+  CHECK(query);
+  if (!query) return (size_t)-1;
+  const XMLNodeSet *set = xml_query_eval(query, node, cache);
+  xml_query_free(query);
+  CHECK(set);
+  return set ? set->len : (size_t)-1;
+}
+
+static void test_query() {
+  XMLNode *doc = xml_parse_string("<shop><item price=\"5\"><name>a</name></item><item price=\"15\"><name>b</name>"
+                                  "<item price=\"1\"><name>c</name></item></item></shop>");
+  XMLQueryCache *cache = xml_query_cache_new();
+  CHECK(query_len(cache, doc, "//item[@price<10]") == 2);
+  CHECK(query_len(cache, doc, "shop/item") == 2);
+  CHECK(query_len(cache, doc, "shop/item/name") == 2);
+  CHECK(query_len(cache, doc, "//item/*") == 4);
+  CHECK(query_len(cache, doc, "//name[text()=\"c\"]") == 1);
+  CHECK(query_len(cache, doc, "//item[@price][@price!='15']/name") == 2);
+  // Results are in document order without duplicates
+  XMLQuery *query = xml_query_compile("//item//name");
+  const XMLNodeSet *set = xml_query_eval(query, doc, cache);
+  CHECK(set && set->len == 3);
+  for (size_t i = 1; set && i < set->len; i++) CHECK(xml_node_compare_order(set->nodes[i - 1], set->nodes[i]) < 0);
+  // Cached result is returned again
+  CHECK(xml_query_eval(query, doc, cache) == set);
+  xml_query_free(query);
+  CHECK(!xml_query_compile("a[@id"));
+  CHECK(!xml_query_compile("a[text()"));
+  CHECK(!xml_query_compile("a[@n>\"x\"]"));
+  xml_query_cache_clear(cache);
+  CHECK(query_len(cache, doc, "shop") == 1);
+  xml_query_cache_free(cache);
+  xml_node_free(doc);
+}
+
+// ---------- Parallel traversal ---------- //
+
+static bool is_item(XMLNode *node, void *user_data) {
+  (void)user_data;
+  return node->tag && strcmp(node->tag, "item") == 0;
+}
+
+static bool sum_item(XMLNode *node, void *user_data) {
+  const char *value = xml_node_attr(node, "v");
+  if (value) XML__ATOMIC_ADD((size_t *)user_data, (size_t)atoi(value));
+  return true;
+}
+
+static bool stop_early(XMLNode *node, void *user_data) {
+  (void)node;
+  return XML__ATOMIC_ADD((size_t *)user_data, 1) < 10;
+}
+
+static void test_parallel_for_each() {
+  // Skewed tree: one big branch and one small one
+  XMLNode *root = xml_node_new(NULL, "r", NULL);
+  XMLNode *big = xml_node_new(root, "big", NULL);
+  size_t expected = 0;
+  for (size_t i = 0; i < 3000; i++) {
+    XMLNode *group = xml_node_new(big, "g", NULL);
+    xml_node_add_attr_uint64(xml_node_new(group, "item", NULL), "v", i % 10);
+    expected += i % 10;
+  }
+  xml_node_add_attr(xml_node_new(xml_node_new(root, "small", NULL), "item", NULL), "v", "5");
+  expected += 5;
+  for (int numbered = 0; numbered < 2; numbered++) {
+    if (numbered) xml_node_update_order(root);
+    size_t threads[] = {1, 2, 4, 0};
+    for (size_t t = 0; t < sizeof(threads) / sizeof(threads[0]); t++) {
+      size_t sum = 0;
+      CHECK(xml_node_parallel_for_each(root, is_item, sum_item, &sum, threads[t]));
+      CHECK(sum == expected);
+    }
+  }
+  size_t visited = 0;
+  CHECK(!xml_node_parallel_for_each(root, NULL, stop_early, &visited, 4));
+  CHECK(xml_node_parallel_for_each(NULL, NULL, stop_early, &visited, 4));
+  xml_node_free(root);
+}
+
+// ---------- Map-reduce ---------- //
+
+typedef struct {
+  size_t count;
+  size_t first; // Index of the first mapped document
+  size_t last;  // Index of the last mapped document
+  bool ordered; // Partial results were combined in order of sources
+} MapResult;
+
+static void *map_document(size_t idx, XMLNode *doc, void *user_data) {
+  (void)user_data;
+  if (!doc || !xml_node_find_tag(doc, "d", true)) return NULL;
+  MapResult *result = (MapResult *)calloc(1, sizeof(MapResult));
+  result->count = xml_node_find_tag(doc, "d", true)->children->len;
+  result->first = result->last = idx;
+  result->ordered = true;
+  return result;
+}
+
+static void *reduce_results(void *left, void *right, void *user_data) {
+  (void)user_data;
+  MapResult *a = (MapResult *)left, *b = (MapResult *)right;
+  a->ordered = a->ordered && b->ordered && a->last < b->first;
+  a->count += b->count;
+  a->last = b->last;
+  free(b);
+  return a;
+}
+
+static void test_map_reduce() {
+  const char *path = "xml_test_map.xml";
+  FILE *file = fopen(path, "w");
+  CHECK(file);
+  if (!file) return;
+  fputs("<d><x/><x/><x/></d>", file);
+  fclose(file);
+  enum { SOURCES = 200 };
+  XMLSource sources[SOURCES];
+  char buffers[SOURCES][64];
+  size_t expected = 0;
+  for (size_t i = 0; i < SOURCES; i++) {
+    memset(&sources[i], 0, sizeof(sources[i]));
+    if (i % 50 == 7) {
+      sources[i].path = i % 100 == 7 ? path : "xml_test_missing.xml";
+      expected += i % 100 == 7 ? 3 : 0;
+      continue;
+    }
+    // Buffers don't end with '\0'
+    int len = snprintf(buffers[i], sizeof(buffers[i]), "<d>%s</d>garbage", i % 2 ? "<x/>" : "<x/><x/>");
+    sources[i].data = buffers[i];
+    sources[i].len = (size_t)len - strlen("garbage");
+    expected += i % 2 ? 1 : 2;
+  }
+  size_t threads[] = {1, 3, 0};
+  for (size_t t = 0; t < sizeof(threads) / sizeof(threads[0]); t++) {
+    MapResult *result = (MapResult *)xml_map_reduce(sources, SOURCES, map_document, reduce_results, NULL, threads[t]);
+    CHECK(result && result->count == expected && result->ordered && result->first == 0);
+    free(result);
+  }
+  CHECK(!xml_map_reduce(sources, 0, map_document, reduce_results, NULL, 2));
+  remove(path);
+}
+
+int main() {
+  test_compact();
+  test_documents();
+  test_free_async();
+  test_allocator();
+  test_parse_file();
+  test_pool_allocator();
+  test_string_modes();
+  test_bulk();
+  test_clone();
+  test_template();
+  test_columns();
+  test_numbers();
+  test_string_buffers();
+  test_iov_sink();
+  test_tag_filters();
+  test_order();
+  test_attr_index();
+  test_children_index();
+  test_sorted_index();
+  test_stream();
+  test_query_set();
+  test_aggregate();
+  test_find_text();
+  test_find_text_shared();
+  test_query();
+  test_parallel_for_each();
+  test_map_reduce();
+  if (failures) {
+    fprintf(stderr, "%d check(s) failed\n", failures);
+    return 1;
+  }
+  printf("All tests passed\n");
+  return 0;
+}
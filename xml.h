@@ -24,16 +24,25 @@ THE SOFTWARE.
 
 ------------------------------------------------------------------------------
 
-xml.h - Header-only C/C++ library to parse XML.
+xml.h - Header-only C/C++ library to parse, query and serialize XML.
 
 ------------------------------------------------------------------------------
 
 Features:
 
-- One tiny header file (~400 lines of code)
+- One stb-style header file (~4700 lines of code), C99 and C++ compatible
 - Parses regular (`<tag>Tag Text</tag>`) and self-closing tags (`<tag/>`)
 - Parses tags attributes (`<tag attribute="value" />`)
-- Ignores comments and processing instructions
+- Ignores comments, processing instructions and <!DOCTYPE ... >
+- Easy to build and serialize XML into reusable string buffers, `writev()` sink, precompiled templates and columnar rows
+- Builder functions with borrowed and transferred strings, capacity reservation, batch adds and number setters
+- Custom allocators per use site and a thread-local pool allocator
+- Compaction of trees into one contiguous block and single-allocation cloning of subtrees
+- Frozen documents shared between threads with lock-free hot swapping, background freeing of large trees
+- Tag name filters pruning searches, pre-order numbering for O(1) ancestry and order checks, attribute value, children by tag and sorted range indexes
+- Streaming matching of one or many paths and aggregation without building a tree
+- Full-text search over element text and compiled path queries with memoized results
+- Parallel traversal with work stealing and map-reduce over many documents
 
 ------------------------------------------------------------------------------
 
@@ -45,6 +54,10 @@ In other files just include "xml.h".
 #define XML_H_IMPLEMENTATION
 #include "xml.h"
 
+Functions that are safe to use from multiple threads rely on GCC/Clang atomic builtins and POSIX threads
+(link with `-pthread`). Define XML_NO_THREADS before including "xml.h" to build without them
+(single-threaded use only), for example with compilers other than GCC and Clang.
+
 ------------------------------------------------------------------------------
 
 */
@@ -58,6 +71,11 @@ extern "C" {
 
 #include <stdbool.h>
 #include <stddef.h>
+#include <stdint.h>
+
+#ifndef _WIN32
+#include <sys/uio.h>
+#endif // _WIN32
 
 // ---------- REDEFINE FUNCTIONS VISIBILITY  ---------- //
 
@@ -82,59 +100,135 @@ extern "C" {
 #define XML_FREE_FUNC free
 #endif // XML_FREE_FUNC
 
+// ---------- XMLAllocator ---------- //
+
+// Allocation functions with user data, used instead of XML_*_FUNC macros.
+// Objects created with an allocator keep pointer to it, so it must outlive them.
+// Functions must behave like calloc, realloc and free.
+typedef struct XMLAllocator {
+  void *(*calloc_func)(void *user_data, size_t count, size_t size);
+  void *(*realloc_func)(void *user_data, void *ptr, size_t size);
+  void (*free_func)(void *user_data, void *ptr);
+  void *user_data; // Passed to every function. Can be used for arenas, pools, etc.
+} XMLAllocator;
+
+// Get allocator that serves small blocks (nodes, attributes, lists, short strings) from thread-local
+// size-class pools, so threads building trees at the same time don't contend on allocator locks.
+// Blocks freed by another thread are returned to the owning thread in batches.
+// Pooled memory is reused, but never returned to the system. Large blocks use XML_*_FUNC macros.
+XML_H_API const XMLAllocator *xml_pool_allocator();
+// Return blocks of other threads freed by this thread that wait for a full batch to their owners.
+// Done automatically when the thread exits. Call it before a long-lived thread goes idle.
+XML_H_API void xml_pool_flush();
+
 // ---------- XMLString ---------- //
 
 // NULL-terminated dynamically-growing string.
 typedef struct {
-  size_t len;  // Length of the string.
-  size_t size; // Capacity of the string in bytes.
-  char *str;   // Pointer to the null-terminated string.
+  size_t len;                    // Length of the string.
+  size_t size;                   // Capacity of the string in bytes.
+  char *str;                     // Pointer to the null-terminated string.
+  const XMLAllocator *allocator; // Allocator of the string. NULL for XML_*_FUNC macros.
 } XMLString;
 
 // Create a new `XMLString`.
 // Returns `NULL` for error.
 // Free with `xml_string_free()`.
 XML_H_API XMLString *xml_string_new();
+// Same as `xml_string_new()`, but string is allocated with `allocator` (can be NULL).
+XML_H_API XMLString *xml_string_new_with_allocator(const XMLAllocator *allocator);
 // Free `XMLString`.
 XML_H_API void xml_string_free(XMLString *str);
 // Append string to the end of the `XMLString`.
 XML_H_API void xml_string_append(XMLString *str, const char *append);
+// Append `len` bytes of `append` to the end of the `XMLString`.
+XML_H_API void xml_string_append_n(XMLString *str, const char *append, size_t len);
+// Append string to the end of the `XMLString`, replacing `&`, `<`, `>`, `"` and `'` with XML entities.
+XML_H_API void xml_string_append_escaped(XMLString *str, const char *append);
+// Append decimal representation of the signed integer.
+XML_H_API void xml_string_append_int64(XMLString *str, int64_t value);
+// Append decimal representation of the unsigned integer.
+XML_H_API void xml_string_append_uint64(XMLString *str, uint64_t value);
+// Append shortest decimal representation of the double that reads back as the same value.
+// Plain notation is used for magnitudes from 1e-6 up to 1e21, `e` notation otherwise (`1e+21`, `1e-7`).
+// Output doesn't depend on the locale. Infinities and NaN are written like in XML Schema: `INF`, `-INF`, `NaN`.
+XML_H_API void xml_string_append_double(XMLString *str, double value);
 // Steal the string pointer from `XMLString` and free the `XMLString`.
-// Caller is responsible for freeing the returned string.
+// Caller is responsible for freeing the returned string with the string's allocator.
 XML_H_API char *xml_string_steal(XMLString *str);
+// Make room for at least `size` bytes (including NULL-terminator) without reallocation.
+XML_H_API void xml_string_reserve(XMLString *str, size_t size);
+// Make the string empty, keeping it's capacity.
+XML_H_API void xml_string_clear(XMLString *str);
+// Make the string empty and shrink it's capacity to `max_size` bytes if it's bigger.
+XML_H_API void xml_string_reset(XMLString *str, size_t max_size);
+// Get empty `XMLString` from the thread-local pool of reusable strings.
+// New strings are created with capacity learned from sizes of strings released before,
+// so in steady state building output doesn't reallocate.
+// Returns `NULL` for error.
+// Return it with `xml_string_release()` (or free with `xml_string_free()`).
+XML_H_API XMLString *xml_string_acquire();
+// Return string to the thread-local pool. It's length is used to learn the size hint.
+// Strings with custom allocator are freed instead.
+XML_H_API void xml_string_release(XMLString *str);
 
 // ---------- XMLList ---------- //
 
 // Simple dynamic list that only can grow in size.
 // Used in XMLNode for list of children and list of tag attributes.
 typedef struct {
-  size_t len;  // Length of the list.
-  size_t size; // Size of the list in bytes.
-  void **data; // List of pointers to list items.
+  size_t len;                    // Length of the list.
+  size_t size;                   // Size of the list in bytes.
+  void **data;                   // List of pointers to list items.
+  bool borrowed;                 // `data` is stored in a compacted block and is not owned by the list. Copied on growth.
+  const XMLAllocator *allocator; // Allocator of the list. NULL for XML_*_FUNC macros.
 } XMLList;
 
 // Create new dynamic array
 XML_H_API XMLList *xml_list_new();
+// Create new dynamic array allocated with `allocator` (can be NULL).
+XML_H_API XMLList *xml_list_new_with_allocator(const XMLAllocator *allocator);
 // Add element to the end of the array. Grow if needed.
 XML_H_API void xml_list_add(XMLList *list, void *data);
+// Grow the array to hold at least `size` elements without reallocation.
+XML_H_API void xml_list_reserve(XMLList *list, size_t size);
 
 // ---------- XMLNode ---------- //
 
+// Ownership of strings passed to `xml_node_new_ex()` and `xml_node_add_attr_ex()`.
+typedef enum {
+  XML_STR_COPY,   // Copy the string.
+  XML_STR_STATIC, // Borrow the string without copying. It must outlive the node (e.g. string literal).
+  XML_STR_TAKE,   // Take ownership of the string. It must be allocated with the node's allocator.
+                  // It's freed if it can't be stored (e.g. the other attribute string is NULL).
+                  // Only NULL node leaves it to the caller.
+} XMLStrMode;
+
 // Tags attribute containing key and value.
 // Like: <tag foo_key="foo_value" bar_key="bar_value" />
 typedef struct XMLAttr {
   char *key;
   char *value;
+  unsigned flags; // Storage flags. Internal, don't modify.
 } XMLAttr;
 
 // The main object to interact with parsed XML nodes. Represents single XML tag.
 typedef struct XMLNode XMLNode;
 struct XMLNode {
-  char *tag;         // Tag string.
-  char *text;        // Inner text of the tag. NULL if tag has no inner text.
-  XMLList *attrs;    // List of tag attributes. Check "node->attrs->len" if it has items.
-  XMLNode *parent;   // Node's parent node. NULL for the root node.
-  XMLList *children; // List of tag's sub-tags. Check "node->children->len" if it has items.
+  char *tag;                     // Tag string.
+  char *text;                    // Inner text of the tag. NULL if tag has no inner text.
+  XMLList *attrs;                // List of tag attributes. Check "node->attrs->len" if it has items.
+  XMLNode *parent;               // Node's parent node. NULL for the root node.
+  XMLList *children;             // List of tag's sub-tags. Check "node->children->len" if it has items.
+  unsigned flags;                // Storage flags. Internal, don't modify.
+  const XMLAllocator *allocator; // Allocator of the node. Inherited from parent. NULL for XML_*_FUNC macros.
+  uint64_t tag_filter;           // Bloom filter of tag names in the node's subtree. Used to skip it in searches.
+  size_t order;                  // Pre-order index of the node in it's tree. Valid if `order_stamp` is not 0.
+  size_t subtree_size;           // Number of nodes in the subtree including the node. Valid if `order_stamp` is not 0.
+  size_t order_stamp;            // Numbering pass that set `order` and `subtree_size`. 0 if invalidated by edits.
+  struct XMLAttrIndex *attr_index;   // Attribute value indexes of the tree. Set only on root nodes. Internal.
+  struct XMLNode *index_root;        // Root of the tree if it has attribute indexes, NULL otherwise. Internal.
+  struct XMLChildIndex *child_index; // Children by tag name index. Built on first lookup on wide nodes. Internal.
 };
 
 // Create new `XMLNode`.
@@ -143,17 +237,45 @@ struct XMLNode {
 // Returns `NULL` for error.
 // Free with `xml_node_free()`.
 XML_H_API XMLNode *xml_node_new(XMLNode *parent, const char *tag, const char *inner_text);
+// Same as `xml_node_new()`, but root node is allocated with `allocator` (can be NULL).
+// If `parent` is not NULL, parent's allocator is used instead.
+XML_H_API XMLNode *xml_node_new_with_allocator(XMLNode *parent, const char *tag, const char *inner_text,
+                                               const XMLAllocator *allocator);
+// Same as `xml_node_new()`, but `tag` and `inner_text` are borrowed without copying.
+// They must outlive the node (e.g. string literals).
+XML_H_API XMLNode *xml_node_new_static(XMLNode *parent, const char *tag, const char *inner_text);
+// Same as `xml_node_new()`, but `tag` and `inner_text` are stored according to `tag_mode` and `text_mode`.
+// See `XMLStrMode`.
+XML_H_API XMLNode *xml_node_new_ex(XMLNode *parent, const char *tag, XMLStrMode tag_mode, const char *inner_text,
+                                   XMLStrMode text_mode);
 // Parse XML string and return root XMLNode.
 // Returns NULL for error.
 // Free with `xml_node_free()`.
 XML_H_API XMLNode *xml_parse_string(const char *xml);
+// Same as `xml_parse_string()`, but all nodes are allocated with `allocator` (can be NULL).
+XML_H_API XMLNode *xml_parse_string_with_allocator(const char *xml, const XMLAllocator *allocator);
+// Same as `xml_parse_string()`, but parses `len` bytes of `data` that don't have to end with '\0'.
+XML_H_API XMLNode *xml_parse_string_n(const char *data, size_t len);
 // Parse XML file for given path and return root XMLNode.
 // Returns NULL for error.
 // Free with `xml_node_free()`.
 XML_H_API XMLNode *xml_parse_file(const char *path);
+// Same as `xml_parse_file()`, but file buffer and all nodes are allocated with `allocator` (can be NULL).
+XML_H_API XMLNode *xml_parse_file_with_allocator(const char *path, const XMLAllocator *allocator);
 // Get child of the node at index.
 // Returns NULL if not found.
 XML_H_API XMLNode *xml_node_child_at(XMLNode *node, size_t idx);
+// Get first child of the node with tag `name`.
+// On nodes with many children the first call builds children index, so next lookups are O(1).
+// Index assumes children are only appended (as all builder functions do).
+// Returns NULL if not found.
+XML_H_API XMLNode *xml_node_child_by_tag(XMLNode *node, const char *name);
+// Iterate over children of the node with tag `name`. `iter` must be set to 0 before the first call.
+// Like:
+//     size_t iter = 0;
+//     for (XMLNode *item; (item = xml_node_children_by_tag(node, "item", &iter));) ...
+// Returns NULL if there are no more children.
+XML_H_API XMLNode *xml_node_children_by_tag(XMLNode *node, const char *name, size_t *iter);
 // Get first matching tag in the tree.
 // It also can search tags by path in the format: `div/p/href`
 // If `exact` is `true` - tag names will be matched exactly.
@@ -164,10 +286,462 @@ XML_H_API XMLNode *xml_node_find_tag(XMLNode *node, const char *tag, bool exact)
 XML_H_API const char *xml_node_attr(XMLNode *node, const char *attr_key);
 // Add attribute with `key` and `value` to the node's list of attributes.
 XML_H_API void xml_node_add_attr(XMLNode *node, const char *key, const char *value);
-// Serialize `XMLNode` into `XMLString`.
+// Number all nodes of the tree containing `node` in pre-order (see `XMLNode.order`).
+// Parser numbers trees it creates, edits invalidate numbering of the edited node's ancestors,
+// and queries below renumber the tree when needed, so calling this is optional.
+// Frozen documents are numbered by `xml_document_freeze()` and never renumbered.
+XML_H_API void xml_node_update_order(XMLNode *node);
+// Check if `ancestor` is an ancestor of `node` (but not the node itself). O(1) if the tree is numbered.
+XML_H_API bool xml_node_is_ancestor(XMLNode *ancestor, XMLNode *node);
+// Compare position of nodes of the same tree in document order.
+// Returns negative number if `a` is before `b`, positive if after and 0 if they're the same node
+// or in different trees (unordered).
+XML_H_API int xml_node_compare_order(XMLNode *a, XMLNode *b);
+// Get number of all descendants of the node. O(1) if the tree is numbered.
+XML_H_API size_t xml_node_descendants_count(XMLNode *node);
+// Build hash index of `key` attribute values of the tree containing `node` for `xml_node_lookup()`.
+// Index is stored on the tree's root node and kept up to date by `xml_node_add_attr()` (and it's variants)
+// and `xml_node_append_children()`. Indexing the same key again does nothing.
+// Returns false for error.
+XML_H_API bool xml_node_index_attr(XMLNode *node, const char *key);
+// Get node of the tree containing `node` that has `key` attribute equal to `value` in O(1).
+// If several nodes have the same value, the first one indexed is returned: the first in document order
+// when the index was built, otherwise the first one added. Nodes added later don't replace it even if
+// they're inserted before it.
+// Returns NULL if not found or `key` is not indexed with `xml_node_index_attr()`.
+XML_H_API XMLNode *xml_node_lookup(XMLNode *node, const char *key, const char *value);
+// Recompute tag filters of the node's subtree (see `XMLNode.tag_filter`).
+// Filters are kept up to date by parser and builder functions, but not by direct changes of `node->tag`
+// or children lists. Call it after such changes, or searches may skip the changed subtrees.
+XML_H_API void xml_node_update_tag_filters(XMLNode *node);
+// Same as `xml_node_add_attr()`, but `key` and `value` are borrowed without copying.
+// They must outlive the node (e.g. string literals).
+XML_H_API void xml_node_add_attr_static(XMLNode *node, const char *key, const char *value);
+// Same as `xml_node_add_attr()`, but node takes ownership of `key` and `value` without copying.
+// They must be allocated with the node's allocator.
+XML_H_API void xml_node_add_attr_take(XMLNode *node, char *key, char *value);
+// Same as `xml_node_add_attr()`, but `key` and `value` are stored according to `key_mode` and `value_mode`.
+// See `XMLStrMode`.
+XML_H_API void xml_node_add_attr_ex(XMLNode *node, const char *key, XMLStrMode key_mode, const char *value,
+                                    XMLStrMode value_mode);
+// Add attribute with `key` and decimal representation of signed integer `value`.
+XML_H_API void xml_node_add_attr_int64(XMLNode *node, const char *key, int64_t value);
+// Add attribute with `key` and decimal representation of unsigned integer `value`.
+XML_H_API void xml_node_add_attr_uint64(XMLNode *node, const char *key, uint64_t value);
+// Add attribute with `key` and shortest decimal representation of `value`. See `xml_string_append_double()`.
+XML_H_API void xml_node_add_attr_double(XMLNode *node, const char *key, double value);
+// Replace node's inner text with a copy of `text` (can be NULL).
+XML_H_API void xml_node_set_text(XMLNode *node, const char *text);
+// Replace node's inner text with decimal representation of signed integer `value`.
+XML_H_API void xml_node_set_text_int64(XMLNode *node, int64_t value);
+// Replace node's inner text with decimal representation of unsigned integer `value`.
+XML_H_API void xml_node_set_text_uint64(XMLNode *node, uint64_t value);
+// Replace node's inner text with shortest decimal representation of `value`. See `xml_string_append_double()`.
+XML_H_API void xml_node_set_text_double(XMLNode *node, double value);
+// Add `n` attributes with `keys[i]` and `values[i]` to the node's list of attributes at once.
+XML_H_API void xml_node_add_attrs(XMLNode *node, const char *const *keys, const char *const *values, size_t n);
+// Make room for at least `n` attributes in total, so adding them doesn't reallocate.
+XML_H_API void xml_node_reserve_attrs(XMLNode *node, size_t n);
+// Make room for at least `n` children in total, so adding them doesn't reallocate.
+XML_H_API void xml_node_reserve_children(XMLNode *node, size_t n);
+// Add `n` root nodes (created with NULL parent) to the end of the node's children list at once.
+// NULL nodes, nodes that already have a parent and the root of node's own tree are skipped,
+// so a node is never linked (and later freed) twice. Returns the number of nodes added.
+XML_H_API size_t xml_node_append_children(XMLNode *node, XMLNode *const *nodes, size_t n);
+// Serialize `XMLNode` into `XMLString`. String grows using it's own allocator.
 XML_H_API void xml_node_serialize(XMLNode *node, XMLString *str);
 // Cleanup node and all it's children recursively.
+// Compacted trees that were not edited after `xml_node_compact()` are freed at once, without walking the tree.
 XML_H_API void xml_node_free(XMLNode *node);
+// Hand node and all it's children to the background thread that frees them with `xml_node_free()`.
+// Returns immediately. Node must not be used after this call.
+// Node must be the root of it's tree (have no parent), as the queue of nodes to free is linked through
+// `node->parent`. Nodes with a parent are not freed and false is returned, free the whole tree instead.
+// Allocation functions must be thread-safe. With XML_NO_THREADS the node is freed immediately.
+// Returns true if the node is freed or queued.
+XML_H_API bool xml_node_free_async(XMLNode *node);
+// Wait until all nodes passed to `xml_node_free_async()` are freed.
+XML_H_API void xml_node_free_wait();
+// Free all queued nodes and stop the background thread (e.g. before exit, so leak checkers see nothing left).
+// Calling `xml_node_free_async()` afterwards starts it again.
+XML_H_API void xml_node_free_shutdown();
+// Relocate node and all it's children into one contiguous memory block in depth-first order.
+// Each node is followed by it's children and attributes arrays, strings are packed after all nodes in the same order.
+// If node has a parent, it's entry in parent's children list is replaced with the relocated node.
+// Old nodes are freed, so all pointers to them become invalid.
+// Compacted tree can still be edited and is freed with `xml_node_free()` as usual,
+// but it's strings must not be freed or reallocated directly.
+// Returns relocated node or NULL for error (in that case `node` is left untouched).
+XML_H_API XMLNode *xml_node_compact(XMLNode *node);
+// Deep copy node and all it's children into one contiguous memory block, laid out like `xml_node_compact()` does.
+// The copy is a new root node (parent is NULL) that can be edited and added to other tree with
+// `xml_node_append_children()`.
+// Returns NULL for error.
+// Free with `xml_node_free()`.
+XML_H_API XMLNode *xml_node_clone(XMLNode *node);
+
+// ---------- XMLSortedIndex ---------- //
+
+// How attribute values of `XMLSortedIndex` are compared.
+typedef enum {
+  XML_NUMERIC, // Values are parsed as numbers. Children with non-numeric values are not indexed.
+  XML_LEXICAL, // Values are compared as strings with `strcmp()`.
+} XMLSortMode;
+
+// Children of the node sorted by attribute value for range queries.
+// It's a snapshot: rebuild it after editing the node.
+typedef struct {
+  XMLSortMode mode;              // How values are compared.
+  size_t len;                    // Number of indexed children.
+  double *keys;                  // Sorted parsed values for `XML_NUMERIC`. NULL for `XML_LEXICAL`.
+  const char **strings;          // Sorted values for `XML_LEXICAL`. NULL for `XML_NUMERIC`.
+  XMLNode **children;            // Children in order of their values. Equal values keep document order.
+  const XMLAllocator *allocator; // Allocator of the indexed node.
+} XMLSortedIndex;
+
+// Build index of children with tag `child_tag` (all children if NULL) that have `attr` attribute.
+// Returns NULL for error.
+// Free with `xml_sorted_index_free()`.
+XML_H_API XMLSortedIndex *xml_node_build_sorted_index(XMLNode *node, const char *child_tag, const char *attr,
+                                                      XMLSortMode mode);
+// Get span of children with numeric values in range `min <= value <= max` in O(log n).
+// Returns pointer to the first child of the span in `index->children` and sets `len` to it's length.
+// Index must be built with `XML_NUMERIC`.
+XML_H_API XMLNode **xml_sorted_index_range(XMLSortedIndex *index, double min, double max, size_t *len);
+// Same as `xml_sorted_index_range()`, but for index built with `XML_LEXICAL`.
+// `min` and `max` can be NULL for open range.
+XML_H_API XMLNode **xml_sorted_index_range_str(XMLSortedIndex *index, const char *min, const char *max,
+                                               size_t *len);
+// Free index.
+XML_H_API void xml_sorted_index_free(XMLSortedIndex *index);
+
+// ---------- Text search ---------- //
+
+// Flags of `xml_node_find_text()`. Can be combined with `|`.
+typedef enum {
+  XML_FIND_TEXT_IGNORE_CASE = 1 << 0, // Ignore case of ASCII letters.
+} XMLFindTextFlags;
+
+// Iterator of `xml_node_find_text()`. Must be zero-initialized: `XMLTextIter iter = {0};`
+typedef struct {
+  XMLNode *node;        // Last visited node. Internal.
+  size_t *path;         // Index of the visited node among it's siblings for every level below the root. Internal.
+  size_t depth;         // Number of levels in `path`. Internal.
+  size_t size;          // Capacity of `path`. Internal.
+  const char *hit;      // Next match in the strings area of compacted tree. Internal.
+  const char *pool_end; // End of the strings area of compacted tree. NULL if tree is searched node by node. Internal.
+  bool started;         // Search has started. Internal.
+  bool done;            // Search has reached the end. Internal.
+} XMLTextIter;
+
+// Find next node in the tree of `root` (including it) whose inner text contains `needle`, in document order.
+// `flags` is a combination of `XMLFindTextFlags`.
+// Like:
+//     XMLTextIter iter = {0};
+//     for (XMLNode *node; (node = xml_node_find_text(root, "error", 0, &iter));) ...
+// Text of not edited compacted trees (see `xml_node_compact()`) is searched in one sweep over their strings.
+// Tree must not be edited during the search.
+// Returns NULL if there are no more nodes. Iterator is freed at that point and next calls keep returning NULL
+// until it's reset with `xml_text_iter_free()`.
+XML_H_API XMLNode *xml_node_find_text(XMLNode *root, const char *needle, unsigned flags, XMLTextIter *iter);
+// Free iterator of the search stopped before `xml_node_find_text()` returned NULL.
+// Iterator can be used for a new search after that.
+XML_H_API void xml_text_iter_free(XMLTextIter *iter);
+
+// ---------- XMLStream ---------- //
+
+// Called for every element matched by `xml_stream_match()` with it's bytes from '<' of the start tag
+// to '>' of the end tag. Parse them with `xml_parse_string_n()` if you need a tree.
+// Return false to stop matching.
+typedef bool (*XMLStreamCallback)(const char *element, size_t len, void *user_data);
+
+// Match elements of `len` bytes of `data` by `path` without building a tree, keeping only the depth of open tags.
+// Path syntax is the same as in `xml_node_find_tag()`: `a/b/c` matches `c` elements inside `b` inside
+// top-level `a`, and a single tag name matches elements at any depth. Tag names are matched exactly.
+// Unlike `xml_node_find_tag()` all matching elements are delivered, in order of their end tags.
+// Returns number of elements passed to `callback`.
+XML_H_API size_t xml_stream_match(const char *data, size_t len, const char *path, XMLStreamCallback callback,
+                                  void *user_data);
+
+// ---------- XMLQuerySet ---------- //
+
+// Set of path queries compiled into one automaton with shared prefixes,
+// so all of them are matched in one pass over the tree or the token stream.
+typedef struct XMLQuerySet XMLQuerySet;
+
+// Called for every node matched by query with ID `query_id`. Return false to stop matching.
+typedef bool (*XMLQueryNodeCallback)(size_t query_id, XMLNode *node, void *user_data);
+// Called for every element matched by query with ID `query_id` with it's bytes (see `XMLStreamCallback`).
+// Return false to stop matching.
+typedef bool (*XMLQueryStreamCallback)(size_t query_id, const char *element, size_t len, void *user_data);
+
+// Create empty query set.
+// Returns NULL for error.
+// Free with `xml_query_set_free()`.
+XML_H_API XMLQuerySet *xml_query_set_new();
+// Add path query with syntax of `xml_stream_match()`. IDs are given in order starting from 0.
+// Returns query ID or (size_t)-1 for error (e.g. empty path).
+XML_H_API size_t xml_query_set_add(XMLQuerySet *set, const char *path);
+// Match all queries against descendants of `node` in one traversal. Paths are relative to `node`.
+// Nodes are delivered in document order, node matched by several queries is delivered for each of them.
+// Subtrees no query can match inside are skipped.
+// Returns number of matches passed to `callback`.
+XML_H_API size_t xml_query_set_match_node(XMLQuerySet *set, XMLNode *node, XMLQueryNodeCallback callback,
+                                          void *user_data);
+// Match all queries against `len` bytes of `data` in one pass without building a tree.
+// Elements are delivered in order of their end tags like in `xml_stream_match()`.
+// Returns number of matches passed to `callback`.
+XML_H_API size_t xml_query_set_match_stream(XMLQuerySet *set, const char *data, size_t len,
+                                            XMLQueryStreamCallback callback, void *user_data);
+// Free query set.
+XML_H_API void xml_query_set_free(XMLQuerySet *set);
+
+// ---------- XMLAggregate ---------- //
+
+// Aggregates computed by `xml_aggregate()`. Can be combined with `|`.
+typedef enum {
+  XML_AGG_COUNT = 1 << 0, // Number of matched elements. Always computed.
+  XML_AGG_SUM = 1 << 1,   // Sum of values.
+  XML_AGG_MIN = 1 << 2,   // Minimum value.
+  XML_AGG_MAX = 1 << 3,   // Maximum value.
+} XMLAggregateOp;
+
+// Result of `xml_aggregate()`. Not requested aggregates are 0.
+typedef struct {
+  size_t count;  // Number of matched elements.
+  size_t values; // Number of numeric values aggregated. Matched elements without a number are skipped.
+  double sum;    // Sum of values.
+  double min;    // Minimum value. 0 if there are no values.
+  double max;    // Maximum value. 0 if there are no values.
+} XMLAggregate;
+
+// Aggregate values of elements matched by `path` (see `xml_stream_match()`) in `len` bytes of `data`
+// in one pass without building a tree.
+// Values are numbers in `attr` attribute of matched elements, or in their text if `attr` is NULL
+// (the first numeric text directly inside the element, also after child elements).
+// `ops` is a combination of `XMLAggregateOp`, values are not parsed for `XML_AGG_COUNT` alone.
+// Returns false for error (e.g. empty path).
+XML_H_API bool xml_aggregate(const char *data, size_t len, const char *path, const char *attr, unsigned ops,
+                             XMLAggregate *result);
+
+// ---------- XMLQuery ---------- //
+
+// Compiled query expression.
+typedef struct XMLQuery XMLQuery;
+// Memo cache of query results for one document.
+typedef struct XMLQueryCache XMLQueryCache;
+
+// Nodes in document order.
+typedef struct {
+  XMLNode **nodes; // Nodes. NULL if there are none.
+  size_t len;      // Number of nodes.
+} XMLNodeSet;
+
+// Compile query expression to bytecode. Expression is a path of steps relative to the node it's evaluated on:
+//     `a/b`           - `b` children of `a` children (leading `/` is optional like in `xml_node_find_tag()`)
+//     `//b`, `a//b`   - `b` descendants at any depth
+//     `a/*`           - children with any tag
+//     `b[@id]`        - `b` with `id` attribute
+//     `b[@id="x"]`    - `b` with `id` attribute equal to `x` (`!=` for not equal)
+//     `b[@n>=10]`     - `b` with numeric `n` attribute compared to number with `<`, `<=`, `>` or `>=`
+//     `b[text()="x"]` - `b` with inner text compared like attributes
+// Predicates can be chained: `b[@id][@n<5]`.
+// Returns NULL for error (e.g. syntax error).
+// Free with `xml_query_free()`.
+XML_H_API XMLQuery *xml_query_compile(const char *expr);
+// Free compiled query.
+XML_H_API void xml_query_free(XMLQuery *query);
+// Create empty query cache.
+// Results of evaluated queries are kept for every sequence of leading steps, so queries sharing leading steps
+// with already evaluated ones (e.g. `a/b[@x]/c` and `a/b[@x]/d`) continue from the cached result.
+// Use one cache per document and clear it when the document is edited.
+// Returns NULL for error.
+// Free with `xml_query_cache_free()`.
+XML_H_API XMLQueryCache *xml_query_cache_new();
+// Drop all cached results.
+XML_H_API void xml_query_cache_clear(XMLQueryCache *cache);
+// Free query cache and all it's results.
+XML_H_API void xml_query_cache_free(XMLQueryCache *cache);
+// Evaluate query from `node` using `cache`.
+// Returned set is owned by the cache and is valid until the cache is cleared or freed.
+// Returns NULL for error.
+XML_H_API const XMLNodeSet *xml_query_eval(XMLQuery *query, XMLNode *node, XMLQueryCache *cache);
+
+// ---------- Parallel traversal ---------- //
+
+// Decides whether `XMLNodeVisitor` is called for the node.
+typedef bool (*XMLNodeFilter)(XMLNode *node, void *user_data);
+// Called for every node that passed the filter. Return false to stop the traversal.
+typedef bool (*XMLNodeVisitor)(XMLNode *node, void *user_data);
+
+// Call `fn` for `root` and all it's descendants that pass `filter` (NULL passes all), using `nthreads` threads
+// (0 for the number of online CPUs). Subtrees are split into tasks that idle threads steal from busy ones.
+// If the tree is numbered (see `xml_node_update_order()`), subtree sizes decide what to split, otherwise
+// subtrees are split while the thread's task queue is short.
+// Nodes are visited in no particular order and `filter` and `fn` are called from several threads at once.
+// They must not add or remove nodes, editing the visited node's attributes and text is fine unless
+// the document has attribute indexes.
+// With XML_NO_THREADS the tree is traversed in the calling thread.
+// Returns false if `fn` stopped the traversal.
+XML_H_API bool xml_node_parallel_for_each(XMLNode *root, XMLNodeFilter filter, XMLNodeVisitor fn, void *user_data,
+                                          size_t nthreads);
+
+// ---------- Map-reduce ---------- //
+
+// Document for `xml_map_reduce()`.
+typedef struct {
+  const char *path; // Path of the file to parse. If NULL, `data` is parsed instead.
+  const char *data; // XML string, doesn't have to end with '\0'.
+  size_t len;       // Length of `data`.
+} XMLSource;
+
+// Map parsed document `idx` to a partial result. `doc` is NULL if the source couldn't be loaded or parsed.
+// Document is freed after the call, so result must not point into it. NULL results are skipped.
+typedef void *(*XMLMapCallback)(size_t idx, XMLNode *doc, void *user_data);
+// Combine two partial results into one. `left` always comes from sources before `right`'s.
+// Both results are passed to the callback, only the returned one is used afterwards.
+typedef void *(*XMLReduceCallback)(void *left, void *right, void *user_data);
+
+// Parse `n` documents from `sources`, map every one with `map_fn` and combine the results with `reduce_fn`
+// using `nthreads` threads (0 for the number of online CPUs).
+// Threads take documents in chunks as they go, so a few big documents don't hold the rest. Each thread reuses
+// it's read buffer and parses with `xml_pool_allocator()`, so node memory is recycled between documents.
+// Results of each chunk are reduced in order, then chunk results are reduced pairwise in a tree.
+// `reduce_fn` must be associative, it doesn't have to be commutative.
+// Callbacks are called from several threads at once.
+// Returns combined result or NULL if there are no results (or for error).
+XML_H_API void *xml_map_reduce(const XMLSource *sources, size_t n, XMLMapCallback map_fn, XMLReduceCallback reduce_fn,
+                               void *user_data, size_t nthreads);
+
+// ---------- XMLIovSink ---------- //
+
+#ifndef _WIN32
+
+#define XML_IOV_SINK_SIZE 64 // Number of entries written with one `writev()` call
+
+// Output that collects pointers to strings and writes them to file descriptor with `writev()`.
+// Initialize with `xml_iov_sink_init()`.
+typedef struct {
+  int fd;                              // File descriptor to write to. Must be in blocking mode.
+  struct iovec iov[XML_IOV_SINK_SIZE]; // Pending entries. Internal.
+  size_t len;                          // Number of pending entries. Internal.
+  size_t written;                      // Number of bytes written.
+  bool error;                          // Writing failed. Check `errno` for reason.
+} XMLIovSink;
+
+// Initialize sink writing to `fd`.
+XML_H_API void xml_iov_sink_init(XMLIovSink *sink, int fd);
+// Write pending entries. Returns false for error.
+XML_H_API bool xml_iov_sink_flush(XMLIovSink *sink);
+// Serialize `XMLNode` into `sink` without copying. Output is the same as of `xml_node_serialize()`, but entries point
+// directly to tags, attributes and texts of the tree, interleaved with static fragments like `</`.
+// Sink is flushed before returning, so the tree can be modified after the call.
+// Returns false for error.
+XML_H_API bool xml_node_serialize_iov(XMLNode *node, XMLIovSink *sink);
+
+#endif // _WIN32
+
+// ---------- XMLDocument ---------- //
+
+// Reference-counted owner of an immutable node tree.
+// Can be shared between threads without locking, as long as nobody modifies it.
+typedef struct XMLDocument {
+  XMLNode *root; // Root node of the document. Read-only.
+  size_t refs;   // Reference count. Internal, use `xml_document_retain()` and `xml_document_release()`.
+} XMLDocument;
+
+// Slot holding currently published document. Readers never block on it.
+// Must be zero-initialized: `XMLDocumentSlot slot = {0};`
+typedef struct {
+  XMLDocument *current; // Currently published document. Use `xml_document_acquire()` to read it.
+  size_t epoch;         // Internal.
+  size_t readers[2];    // Internal.
+  bool publishing;      // Internal.
+} XMLDocumentSlot;
+
+// Freeze the tree into immutable document snapshot with reference count of 1.
+// Document is allocated with the allocator of `root`.
+// Takes ownership of `root` (it must not have a parent). Tree is compacted with `xml_node_compact()`,
+// so `root` pointer becomes invalid, use `doc->root` instead.
+// Returns NULL for error (in that case `root` is left untouched).
+// Free with `xml_document_release()`.
+XML_H_API XMLDocument *xml_document_freeze(XMLNode *root);
+// Increase document reference count. Returns `doc`.
+XML_H_API XMLDocument *xml_document_retain(XMLDocument *doc);
+// Decrease document reference count. Document is freed when it drops to zero.
+XML_H_API void xml_document_release(XMLDocument *doc);
+// Get currently published document with increased reference count. Never blocks.
+// Returns NULL if nothing is published.
+// Release with `xml_document_release()` when done reading.
+XML_H_API XMLDocument *xml_document_acquire(XMLDocumentSlot *slot);
+// Index `key` attribute values of the document. See `xml_node_index_attr()`.
+// Not thread-safe: index documents before sharing them with other threads.
+// Returns false for error.
+XML_H_API bool xml_document_index_attr(XMLDocument *doc, const char *key);
+// Get node of the document with `key` attribute equal to `value`. See `xml_node_lookup()`.
+// Safe to call from many threads at once.
+XML_H_API XMLNode *xml_document_lookup(XMLDocument *doc, const char *key, const char *value);
+// Atomically replace published document with `doc` (can be NULL). Takes ownership of caller's reference to `doc`.
+// Old document is retired: it's freed once all readers that acquired it release it.
+// Waits only for readers that are in the middle of `xml_document_acquire()`, never for readers holding a document.
+XML_H_API void xml_document_publish(XMLDocumentSlot *slot, XMLDocument *doc);
+
+// ---------- XMLTemplate ---------- //
+
+// Part of the compiled template: static text or placeholder.
+typedef struct {
+  size_t start; // Offset of static text in template's `text`, or placeholder's index in `names`.
+  size_t len;   // Length of static text. 0 for placeholders.
+} XMLTemplatePart;
+
+// Precompiled XML text with `{name}` placeholders that is rendered without building a tree.
+// Use `{{` and `}}` for literal braces.
+typedef struct {
+  char *text;             // All static text of the template.
+  XMLTemplatePart *parts; // Static text and placeholders in order.
+  size_t parts_len;       // Number of parts.
+  size_t static_len;      // Length of all static text.
+  char **names;           // Placeholder names in order of first appearance.
+  size_t names_len;       // Number of distinct placeholders.
+} XMLTemplate;
+
+// Compile template like `<a id="{id}">{name}</a>`.
+// Returns NULL for error (e.g. placeholder is not closed).
+// Free with `xml_template_free()`.
+XML_H_API XMLTemplate *xml_template_compile(const char *source);
+// Get index of placeholder's value in `values` of `xml_template_render()`.
+// Returns (size_t)-1 if template has no such placeholder.
+XML_H_API size_t xml_template_index(XMLTemplate *tmpl, const char *name);
+// Append rendered template to `str`. `values` has one value for every name in `tmpl->names`.
+// Static text is copied as is, values are escaped. NULL values are rendered as empty strings.
+XML_H_API void xml_template_render(XMLTemplate *tmpl, const char *const *values, XMLString *str);
+// Free template.
+XML_H_API void xml_template_free(XMLTemplate *tmpl);
+
+// ---------- XMLColumn ---------- //
+
+// Type of the column values.
+typedef enum {
+  XML_COLUMN_STRING, // `const char *` values. NULL values are skipped.
+  XML_COLUMN_INT64,  // `int64_t` values.
+  XML_COLUMN_UINT64, // `uint64_t` values.
+  XML_COLUMN_DOUBLE, // `double` values.
+  XML_COLUMN_BOOL,   // `bool` values written as `true` or `false`.
+} XMLColumnType;
+
+// Column of rows written by `xml_emit_columns()`.
+typedef struct {
+  const char *name;   // Attribute or child element name.
+  XMLColumnType type; // Type of values in `data`.
+  bool element;       // Write values as child elements `<name>value</name>` instead of attributes.
+  const void *data;   // Array of values, one per row.
+} XMLColumn;
+
+// Append `rows_len` elements `<row_tag column="value" ...>` built from column arrays straight to `str`,
+// without creating nodes. Rows without child element columns are self-closing.
+// String values are escaped, numbers are formatted without `printf()` where possible.
+XML_H_API void xml_emit_columns(XMLString *str, const char *row_tag, const XMLColumn *columns, size_t columns_len,
+                                size_t rows_len);
 
 #ifdef __cplusplus
 }
@@ -185,26 +759,99 @@ XML_H_API void xml_node_free(XMLNode *node);
 #include <stdio.h>
 #include <string.h>
 
-#define XML_FREE(ptr)                                                                                                  \
+#define XML_FREE(allocator, ptr)                                                                                       \
   if (ptr) {                                                                                                           \
-    XML_FREE_FUNC(ptr);                                                                                                \
+    xml__free(allocator, ptr);                                                                                         \
     ptr = NULL;                                                                                                        \
   }
 
+// Storage flags for parts of XMLNode and XMLAttr that are not allocated on their own
+// (e.g. live inside the block created by `xml_node_compact()`) and must not be freed separately.
+#define XML__NODE_BORROWED (1u << 0)  // XMLNode struct itself
+#define XML__TAG_BORROWED (1u << 1)   // node->tag
+#define XML__TEXT_BORROWED (1u << 2)  // node->text
+#define XML__LISTS_BORROWED (1u << 3) // node->attrs and node->children XMLList structs
+#define XML__BLOCK_EDITED (1u << 4)   // Set on the compacted block owner when any node inside it is edited
+#define XML__ATTR_BORROWED (1u << 0)  // XMLAttr struct itself
+#define XML__KEY_BORROWED (1u << 1)   // attr->key
+#define XML__VALUE_BORROWED (1u << 2) // attr->value
+
+#ifndef XML_NO_THREADS
+#if !defined(__GNUC__) && !defined(__clang__)
+#error "xml.h: thread-safe functions need GCC/Clang __atomic builtins, define XML_NO_THREADS to build without them"
+#endif // !__GNUC__ && !__clang__
+#include <pthread.h>
+#include <sched.h>
+#define XML__ATOMIC_LOAD(ptr) __atomic_load_n(ptr, __ATOMIC_SEQ_CST)
+#define XML__ATOMIC_LOAD_RELAXED(ptr) __atomic_load_n(ptr, __ATOMIC_RELAXED)
+#define XML__ATOMIC_STORE(ptr, val) __atomic_store_n(ptr, val, __ATOMIC_SEQ_CST)
+#define XML__ATOMIC_ADD(ptr, val) __atomic_add_fetch(ptr, val, __ATOMIC_SEQ_CST)
+#define XML__ATOMIC_SUB(ptr, val) __atomic_sub_fetch(ptr, val, __ATOMIC_SEQ_CST)
+#define XML__ATOMIC_EXCHANGE(ptr, val) __atomic_exchange_n(ptr, val, __ATOMIC_SEQ_CST)
+#define XML__ATOMIC_OR(ptr, val) __atomic_or_fetch(ptr, val, __ATOMIC_SEQ_CST)
+#define XML__ATOMIC_CAS(ptr, expected, desired)                                                                       \
+  __atomic_compare_exchange_n(ptr, expected, desired, false, __ATOMIC_SEQ_CST, __ATOMIC_SEQ_CST)
+#define XML__YIELD() sched_yield()
+#if defined(__cplusplus) && __cplusplus >= 201103L
+#define XML__THREAD_LOCAL thread_local
+#elif defined(__STDC_VERSION__) && __STDC_VERSION__ >= 201112L
+#define XML__THREAD_LOCAL _Thread_local
+#else
+#define XML__THREAD_LOCAL __thread
+#endif // __cplusplus
+#else
+#define XML__ATOMIC_LOAD(ptr) (*(ptr))
+#define XML__ATOMIC_LOAD_RELAXED(ptr) (*(ptr))
+#define XML__ATOMIC_STORE(ptr, val) (*(ptr) = (val))
+#define XML__ATOMIC_ADD(ptr, val) (*(ptr) += (val))
+#define XML__ATOMIC_SUB(ptr, val) (*(ptr) -= (val))
+#define XML__ATOMIC_EXCHANGE(ptr, val) xml__exchange((void **)(ptr), (val))
+#define XML__ATOMIC_OR(ptr, val) (*(ptr) |= (val))
+#define XML__ATOMIC_CAS(ptr, expected, desired)                                                                       \
+  (*(ptr) == *(expected) ? (*(ptr) = (desired), true) : (*(expected) = *(ptr), false))
+#define XML__YIELD()
+#define XML__THREAD_LOCAL
+static inline void *xml__exchange(void **ptr, void *val) {
+  void *old = *ptr;
+  *ptr = val;
+  return old;
+}
+#endif // XML_NO_THREADS
+
+// ---------- XMLAllocator ---------- //
+
+static inline void *xml__calloc(const XMLAllocator *allocator, size_t count, size_t size) {
+  return allocator ? allocator->calloc_func(allocator->user_data, count, size) : XML_CALLOC_FUNC(count, size);
+}
+
+static inline void *xml__realloc(const XMLAllocator *allocator, void *ptr, size_t size) {
+  return allocator ? allocator->realloc_func(allocator->user_data, ptr, size) : XML_REALLOC_FUNC(ptr, size);
+}
+
+static inline void xml__free(const XMLAllocator *allocator, void *ptr) {
+  if (allocator) allocator->free_func(allocator->user_data, ptr);
+  else XML_FREE_FUNC(ptr);
+}
+
+// Round size up to pointer alignment.
+#define XML__ALIGN(size) (((size) + sizeof(void *) - 1) & ~(sizeof(void *) - 1))
+
 static inline void xml__skip_whitespace(const char *xml, size_t *idx) {
   while (xml[*idx] != '\0' && isspace((unsigned char)xml[*idx])) (*idx)++;
 }
 
-static inline char *xml__strndup(const char *str, size_t n) {
-  void *dup = XML_CALLOC_FUNC(1, n + 1);
-  memcpy(dup, str, n);
-  return dup;
+static inline char *xml__strndup(const XMLAllocator *allocator, const char *str, size_t n) {
+  void *dup = xml__calloc(allocator, 1, n + 1);
+  if (dup) memcpy(dup, str, n);
+  return (char *)dup;
 }
 
-static inline char *xml__strdup(const char *str) { return xml__strndup(str, strlen(str)); }
+static inline char *xml__strdup(const XMLAllocator *allocator, const char *str) {
+  return xml__strndup(allocator, str, strlen(str));
+}
 
-static char *xml__decode_entities(const char *str, size_t len) {
-  XMLString *decoded = xml_string_new();
+static char *xml__decode_entities(const XMLAllocator *allocator, const char *str, size_t len) {
+  XMLString *decoded = xml_string_new_with_allocator(allocator);
   size_t i = 0;
   while (i < len) {
     if (str[i] == '&') {
@@ -238,186 +885,1387 @@ static char *xml__decode_entities(const char *str, size_t len) {
   return xml_string_steal(decoded);
 }
 
+// ---------- XMLPool ---------- //
+
+#define XML__POOL_CLASSES 5            // Size classes: 16, 32, 64, 128, 256 bytes
+#define XML__POOL_MAX_SIZE 256         // Bigger blocks are allocated with XML_*_FUNC macros
+#define XML__POOL_CHUNK_SIZE 65536     // Size of memory chunks pools carve blocks from
+#define XML__POOL_BATCH 64             // Number of blocks freed by other thread returned at once
+
+typedef struct XMLPool XMLPool;
+
+// Header in front of every block. Free blocks are linked through their first pointer.
+typedef struct {
+  XMLPool *pool; // Owner pool. NULL for large blocks.
+  size_t size;   // Size class index or size of the large block.
+} XMLPoolHeader;
+
+struct XMLPool {
+  void *free_lists[XML__POOL_CLASSES]; // Free blocks of this pool
+  void *remote;                        // Blocks freed by other threads. Atomic stack.
+  XMLPool *batch_pool;                 // Pool of blocks in the outgoing batch
+  void *batch_head, *batch_tail;       // Blocks of other pool freed by this thread
+  size_t batch_len;                    // Number of blocks in the outgoing batch
+  char *chunk;                         // Current memory chunk
+  size_t chunk_left;                   // Bytes left in the current chunk
+  XMLPool *next_orphan;                // Next pool left by exited thread
+};
+
+static XML__THREAD_LOCAL XMLPool *xml__pool_local = NULL;
+
+#define XML__POOL_NEXT(block) (*(void **)(block))
+#define XML__POOL_HEADER(block) ((XMLPoolHeader *)(block) - 1)
+
+// Push outgoing batch to it's owner pool.
+static void xml__pool_flush(XMLPool *pool) {
+  if (!pool->batch_len) return;
+  void *head = XML__ATOMIC_LOAD(&pool->batch_pool->remote);
+  do {
+    XML__POOL_NEXT(pool->batch_tail) = head;
+  } while (!XML__ATOMIC_CAS(&pool->batch_pool->remote, &head, pool->batch_head));
+  pool->batch_pool = NULL;
+  pool->batch_head = pool->batch_tail = NULL;
+  pool->batch_len = 0;
+}
+
+#ifndef XML_NO_THREADS
+static pthread_once_t xml__pool_once = PTHREAD_ONCE_INIT;
+static pthread_key_t xml__pool_key;
+static pthread_mutex_t xml__pool_mutex = PTHREAD_MUTEX_INITIALIZER;
+static XMLPool *xml__pool_orphans = NULL; // Pools of exited threads waiting for adoption
+
+// Give pool of the exiting thread to the next new thread.
+static void xml__pool_orphan(void *ptr) {
+  XMLPool *pool = (XMLPool *)ptr;
+  xml__pool_local = NULL;
+  xml__pool_flush(pool);
+  pthread_mutex_lock(&xml__pool_mutex);
+  pool->next_orphan = xml__pool_orphans;
+  xml__pool_orphans = pool;
+  pthread_mutex_unlock(&xml__pool_mutex);
+}
+
+static void xml__pool_key_create() { pthread_key_create(&xml__pool_key, xml__pool_orphan); }
+#endif // XML_NO_THREADS
+
+// Get pool of the current thread.
+static XMLPool *xml__pool_get() {
+  if (xml__pool_local) return xml__pool_local;
+  XMLPool *pool = NULL;
+#ifndef XML_NO_THREADS
+  pthread_once(&xml__pool_once, xml__pool_key_create);
+  pthread_mutex_lock(&xml__pool_mutex);
+  if (xml__pool_orphans) {
+    pool = xml__pool_orphans;
+    xml__pool_orphans = pool->next_orphan;
+  }
+  pthread_mutex_unlock(&xml__pool_mutex);
+#endif // XML_NO_THREADS
+  if (!pool) pool = (XMLPool *)XML_CALLOC_FUNC(1, sizeof(XMLPool));
+  if (!pool) return NULL;
+#ifndef XML_NO_THREADS
+  pthread_setspecific(xml__pool_key, pool);
+#endif // XML_NO_THREADS
+  xml__pool_local = pool;
+  return pool;
+}
+
+static inline size_t xml__pool_class(size_t size) {
+  size_t class_idx = 0;
+  while (((size_t)16 << class_idx) < size) class_idx++;
+  return class_idx;
+}
+
+// Allocate uninitialized block of `size` bytes.
+static void *xml__pool_alloc(size_t size) {
+  if (size > XML__POOL_MAX_SIZE) {
+    XMLPoolHeader *header = (XMLPoolHeader *)XML_CALLOC_FUNC(1, sizeof(XMLPoolHeader) + size);
+    if (!header) return NULL;
+    header->size = size;
+    return header + 1;
+  }
+  XMLPool *pool = xml__pool_get();
+  if (!pool) return NULL;
+  size_t class_idx = xml__pool_class(size);
+  // Take back blocks freed by other threads
+  if (!pool->free_lists[class_idx] && XML__ATOMIC_LOAD(&pool->remote)) {
+    void *block = XML__ATOMIC_EXCHANGE(&pool->remote, NULL);
+    while (block) {
+      void *next = XML__POOL_NEXT(block);
+      size_t block_class = XML__POOL_HEADER(block)->size;
+      XML__POOL_NEXT(block) = pool->free_lists[block_class];
+      pool->free_lists[block_class] = block;
+      block = next;
+    }
+  }
+  void *block = pool->free_lists[class_idx];
+  if (block) {
+    pool->free_lists[class_idx] = XML__POOL_NEXT(block);
+    return block;
+  }
+  // Carve new block from the chunk
+  size_t block_size = sizeof(XMLPoolHeader) + ((size_t)16 << class_idx);
+  if (pool->chunk_left < block_size) {
+    pool->chunk = (char *)XML_CALLOC_FUNC(1, XML__POOL_CHUNK_SIZE);
+    if (!pool->chunk) {
+      pool->chunk_left = 0;
+      return NULL;
+    }
+    pool->chunk_left = XML__POOL_CHUNK_SIZE;
+  }
+  XMLPoolHeader *header = (XMLPoolHeader *)pool->chunk;
+  pool->chunk += block_size;
+  pool->chunk_left -= block_size;
+  header->pool = pool;
+  header->size = class_idx;
+  return header + 1;
+}
+
+static void xml__pool_free_func(void *user_data, void *ptr) {
+  (void)user_data;
+  if (!ptr) return;
+  XMLPoolHeader *header = XML__POOL_HEADER(ptr);
+  if (!header->pool) {
+    XML_FREE_FUNC(header);
+    return;
+  }
+  XMLPool *pool = xml__pool_get();
+  if (header->pool == pool) {
+    XML__POOL_NEXT(ptr) = pool->free_lists[header->size];
+    pool->free_lists[header->size] = ptr;
+    return;
+  }
+  // Block of other thread. Collect a batch before returning it.
+  if (!pool) {
+    void *head = XML__ATOMIC_LOAD(&header->pool->remote);
+    do {
+      XML__POOL_NEXT(ptr) = head;
+    } while (!XML__ATOMIC_CAS(&header->pool->remote, &head, ptr));
+    return;
+  }
+  if (pool->batch_pool != header->pool) {
+    xml__pool_flush(pool);
+    pool->batch_pool = header->pool;
+    pool->batch_tail = ptr;
+  }
+  XML__POOL_NEXT(ptr) = pool->batch_head;
+  pool->batch_head = ptr;
+  if (++pool->batch_len >= XML__POOL_BATCH) xml__pool_flush(pool);
+}
+
+static void *xml__pool_calloc_func(void *user_data, size_t count, size_t size) {
+  (void)user_data;
+  if (size && count > SIZE_MAX / size) return NULL;
+  void *ptr = xml__pool_alloc(count * size);
+  if (ptr) memset(ptr, 0, count * size);
+  return ptr;
+}
+
+static void *xml__pool_realloc_func(void *user_data, void *ptr, size_t size) {
+  if (!ptr) return xml__pool_alloc(size);
+  XMLPoolHeader *header = XML__POOL_HEADER(ptr);
+  size_t capacity = header->pool ? ((size_t)16 << header->size) : header->size;
+  if (size <= capacity) return ptr;
+  if (!header->pool) {
+    header = (XMLPoolHeader *)XML_REALLOC_FUNC(header, sizeof(XMLPoolHeader) + size);
+    if (!header) return NULL;
+    header->size = size;
+    return header + 1;
+  }
+  void *grown = xml__pool_alloc(size);
+  if (!grown) return NULL;
+  memcpy(grown, ptr, capacity);
+  xml__pool_free_func(user_data, ptr);
+  return grown;
+}
+
+static const XMLAllocator xml__pool_allocator = {xml__pool_calloc_func, xml__pool_realloc_func, xml__pool_free_func,
+                                                 NULL};
+
+XML_H_API const XMLAllocator *xml_pool_allocator() { return &xml__pool_allocator; }
+
+XML_H_API void xml_pool_flush() {
+  if (xml__pool_local) xml__pool_flush(xml__pool_local);
+}
+
 // ---------- XMLString ---------- //
 
-XML_H_API XMLString *xml_string_new() {
-  XMLString *str = (XMLString *)XML_CALLOC_FUNC(1, sizeof(XMLString));
+XML_H_API XMLString *xml_string_new() { return xml_string_new_with_allocator(NULL); }
+
+XML_H_API XMLString *xml_string_new_with_allocator(const XMLAllocator *allocator) {
+  XMLString *str = (XMLString *)xml__calloc(allocator, 1, sizeof(XMLString));
+  str->allocator = allocator;
   str->len = 0;
   str->size = 64;
-  str->str = (char *)XML_CALLOC_FUNC(1, str->size);
+  str->str = (char *)xml__calloc(allocator, 1, str->size);
   str->str[0] = '\0';
   return str;
 }
 
+// Make room for `extra` more bytes.
+static inline void xml__string_reserve(XMLString *str, size_t extra) {
+  if (str->len + extra + 1 > str->size) {
+    str->size = (str->len + extra + 1) * 2;
+    str->str = (char *)xml__realloc(str->allocator, str->str, str->size);
+  }
+}
+
+XML_H_API void xml_string_append_n(XMLString *str, const char *append, size_t len) {
+  if (!str || !append) return;
+  xml__string_reserve(str, len);
+  memcpy(str->str + str->len, append, len);
+  str->len += len;
+  str->str[str->len] = '\0';
+}
+
 XML_H_API void xml_string_append(XMLString *str, const char *append) {
   if (!str || !append) return;
-  size_t append_len = strlen(append);
-  if (str->len + append_len + 1 > str->size) {
-    str->size = (str->len + append_len + 1) * 2;
-    str->str = (char *)XML_REALLOC_FUNC(str->str, str->size);
+  xml_string_append_n(str, append, strlen(append));
+}
+
+// Check if any byte of the word is equal to `byte`.
+#define XML__HAS_BYTE(word, byte)                                                                                      \
+  ((((word) ^ (0x0101010101010101ull * (byte))) - 0x0101010101010101ull) & ~((word) ^ (0x0101010101010101ull * (byte))) & \
+   0x8080808080808080ull)
+
+// Find first byte that needs escaping. Checks 8 bytes at a time.
+static inline size_t xml__escape_scan(const char *str, size_t len) {
+  size_t i = 0;
+  for (; i + 8 <= len; i += 8) {
+    uint64_t word;
+    memcpy(&word, str + i, 8);
+    if (XML__HAS_BYTE(word, '&') | XML__HAS_BYTE(word, '<') | XML__HAS_BYTE(word, '>') | XML__HAS_BYTE(word, '"') |
+        XML__HAS_BYTE(word, '\''))
+      break;
   }
-  strcpy(str->str + str->len, append);
-  str->len += append_len;
+  for (; i < len; i++)
+    if (str[i] == '&' || str[i] == '<' || str[i] == '>' || str[i] == '"' || str[i] == '\'') break;
+  return i;
 }
 
-XML_H_API void xml_string_free(XMLString *str) {
-  if (!str) return;
-  XML_FREE(str->str);
-  XML_FREE(str);
+static void xml__string_append_escaped_n(XMLString *str, const char *append, size_t len) {
+  while (len > 0) {
+    // Copy unescaped run at once
+    size_t run = xml__escape_scan(append, len);
+    xml_string_append_n(str, append, run);
+    if (run == len) return;
+    switch (append[run]) {
+    case '&': xml_string_append_n(str, "&amp;", 5); break;
+    case '<': xml_string_append_n(str, "&lt;", 4); break;
+    case '>': xml_string_append_n(str, "&gt;", 4); break;
+    case '"': xml_string_append_n(str, "&quot;", 6); break;
+    default: xml_string_append_n(str, "&apos;", 6); break;
+    }
+    append += run + 1;
+    len -= run + 1;
+  }
 }
 
-XML_H_API char *xml_string_steal(XMLString *str) {
-  if (!str) return NULL;
-  char *stealed = str->str;
-  XML_FREE(str);
-  return stealed;
+XML_H_API void xml_string_append_escaped(XMLString *str, const char *append) {
+  if (!str || !append) return;
+  xml__string_append_escaped_n(str, append, strlen(append));
 }
 
-// ---------- XMLList ---------- //
+// ---------- Numbers formatting ---------- //
 
-// Create new dynamic array
-XML_H_API XMLList *xml_list_new() {
-  XMLList *list = (XMLList *)XML_CALLOC_FUNC(1, sizeof(XMLList));
-  list->len = 0;
-  list->size = 32;
-  list->data = XML_CALLOC_FUNC(1, sizeof(void *) * list->size);
-  return list;
+static const char xml__digit_pairs[] = "000102030405060708091011121314151617181920212223242526272829303132333435363738"
+                                       "394041424344454647484950515253545556575859606162636465666768697071727374757677"
+                                       "78798081828384858687888990919293949596979899";
+
+// Write decimal digits of `value` to `buf` (at least 20 bytes). Returns length. Not NULL-terminated.
+static size_t xml__format_uint64(char *buf, uint64_t value) {
+  char tmp[20];
+  char *end = tmp + sizeof(tmp), *p = end;
+  // Two digits at a time
+  while (value >= 100) {
+    const char *pair = xml__digit_pairs + (value % 100) * 2;
+    value /= 100;
+    *--p = pair[1];
+    *--p = pair[0];
+  }
+  if (value >= 10) {
+    const char *pair = xml__digit_pairs + value * 2;
+    *--p = pair[1];
+    *--p = pair[0];
+  } else *--p = (char)('0' + value);
+  memcpy(buf, p, end - p);
+  return end - p;
 }
 
-// Add element to the end of the array. Grow if needed.
-XML_H_API void xml_list_add(XMLList *list, void *data) {
-  if (!list || !data) return;
-  if (list->len >= list->size) {
-    list->size *= 2;
-    list->data = XML_REALLOC_FUNC(list->data, list->size * sizeof(void *));
+// Same as `xml__format_uint64()`, but signed. `buf` must be at least 21 bytes.
+static size_t xml__format_int64(char *buf, int64_t value) {
+  if (value >= 0) return xml__format_uint64(buf, (uint64_t)value);
+  buf[0] = '-';
+  return 1 + xml__format_uint64(buf + 1, -(uint64_t)value);
+}
+
+// Big unsigned integer for exact shortest double formatting. Fixed size, never allocates.
+#define XML__BIG_LIMBS 40 // 1280 bits, enough for any double scaled by a power of 10
+
+typedef struct {
+  uint32_t limbs[XML__BIG_LIMBS]; // Least significant first
+  size_t len;                     // Number of used limbs, no leading zero limbs
+} XMLBig;
+
+static void xml__big_set(XMLBig *big, uint64_t value) {
+  big->len = 0;
+  for (; value; value >>= 32) big->limbs[big->len++] = (uint32_t)value;
+}
+
+static void xml__big_mul(XMLBig *big, uint32_t factor) {
+  uint64_t carry = 0;
+  for (size_t i = 0; i < big->len; i++) {
+    carry += (uint64_t)big->limbs[i] * factor;
+    big->limbs[i] = (uint32_t)carry;
+    carry >>= 32;
   }
-  list->data[list->len++] = data;
+  if (carry) big->limbs[big->len++] = (uint32_t)carry;
 }
 
-// ---------- XMLNode ---------- //
+static void xml__big_mul_pow10(XMLBig *big, int n) {
+  for (; n >= 9; n -= 9) xml__big_mul(big, 1000000000);
+  static const uint32_t pow10[] = {1, 10, 100, 1000, 10000, 100000, 1000000, 10000000, 100000000};
+  if (n) xml__big_mul(big, pow10[n]);
+}
 
-XML_H_API XMLNode *xml_node_new(XMLNode *parent, const char *tag, const char *inner_text) {
-  XMLNode *node = XML_CALLOC_FUNC(1, sizeof(XMLNode));
-  node->parent = parent;
-  node->tag = tag ? xml__strdup(tag) : NULL;
-  node->text = inner_text ? xml__strdup(inner_text) : NULL;
-  node->children = xml_list_new();
-  node->attrs = xml_list_new();
-  if (parent) xml_list_add(parent->children, node);
-  return node;
+static void xml__big_shift(XMLBig *big, unsigned bits) {
+  if (!big->len) return;
+  size_t words = bits / 32;
+  bits %= 32;
+  big->limbs[big->len] = 0;
+  for (size_t i = big->len + 1; i-- > 0;) {
+    uint32_t low = i ? big->limbs[i - 1] : 0;
+    uint32_t value = bits ? (big->limbs[i] << bits) | (low >> (32 - bits)) : big->limbs[i];
+    big->limbs[i + words] = value;
+  }
+  for (size_t i = 0; i < words; i++) big->limbs[i] = 0;
+  big->len += words + 1;
+  while (big->len && !big->limbs[big->len - 1]) big->len--;
 }
 
-XML_H_API void xml_node_add_attr(XMLNode *node, const char *key, const char *value) {
-  XMLAttr *attr = XML_CALLOC_FUNC(1, sizeof(XMLAttr));
-  attr->key = xml__strdup(key);
-  attr->value = xml__strdup(value);
-  xml_list_add(node->attrs, attr);
+static int xml__big_compare(const XMLBig *a, const XMLBig *b) {
+  if (a->len != b->len) return a->len < b->len ? -1 : 1;
+  for (size_t i = a->len; i-- > 0;)
+    if (a->limbs[i] != b->limbs[i]) return a->limbs[i] < b->limbs[i] ? -1 : 1;
+  return 0;
 }
 
-XML_H_API XMLNode *xml_node_child_at(XMLNode *node, size_t index) {
-  if (!node || !node->children) return NULL;
-  if (index >= node->children->len) return NULL;
-  return (XMLNode *)node->children->data[index];
+// Compare `a + b` with `c`.
+static int xml__big_compare_sum(const XMLBig *a, const XMLBig *b, const XMLBig *c) {
+  XMLBig sum;
+  const XMLBig *longer = a->len >= b->len ? a : b, *shorter = a->len >= b->len ? b : a;
+  uint64_t carry = 0;
+  for (size_t i = 0; i < longer->len; i++) {
+    carry += (uint64_t)longer->limbs[i] + (i < shorter->len ? shorter->limbs[i] : 0);
+    sum.limbs[i] = (uint32_t)carry;
+    carry >>= 32;
+  }
+  sum.len = longer->len;
+  if (carry) sum.limbs[sum.len++] = (uint32_t)carry;
+  return xml__big_compare(&sum, c);
 }
 
-XML_H_API XMLNode *xml_node_find_tag(XMLNode *node, const char *tag, bool exact) {
-  if (!node || !tag) return NULL;
-  // If tag doesn't contain any '/' then it's a single tag search
-  if (!strchr(tag, '/')) {
-    // Check if the current node matches the tag
-    if (node->tag && ((exact && strcmp(node->tag, tag) == 0) || (!exact && strstr(node->tag, tag) != NULL)))
-      return node;
-    // Recursively search through the children of the node
-    for (size_t i = 0; i < node->children->len; i++) {
-      XMLNode *result = xml_node_find_tag(node->children->data[i], tag, exact);
-      if (result) return result; // Return the first match found
-    }
-    return NULL;
+// Subtract `b` from `a`. `a` must not be less than `b`.
+static void xml__big_sub(XMLBig *a, const XMLBig *b) {
+  int64_t borrow = 0;
+  for (size_t i = 0; i < a->len; i++) {
+    borrow += (int64_t)a->limbs[i] - (i < b->len ? b->limbs[i] : 0);
+    a->limbs[i] = (uint32_t)borrow;
+    borrow = borrow < 0 ? -1 : 0;
   }
-  // Path tag search
-  char *tokenized_path = xml__strdup(tag);
-  if (!tokenized_path) return NULL;
-  char *segment = strtok(tokenized_path, "/");
-  XMLNode *current = node;
-  while (segment && current) {
-    bool found = false;
-    for (size_t i = 0; i < current->children->len; i++) {
-      XMLNode *child = (XMLNode *)current->children->data[i];
-      if (!child->tag) continue;
-      if ((exact && strcmp(child->tag, segment) == 0) || (!exact && strstr(child->tag, segment) != NULL)) {
-        current = child;
-        found = true;
-        break;
-      }
+  while (a->len && !a->limbs[a->len - 1]) a->len--;
+}
+
+// Write shortest digits of positive finite `value` that read back as the same value (Burger and Dybvig's
+// free-format algorithm with exact integers). Digits are written to `digits` (at least 17 bytes), and
+// `value` is close to 0.DIGITS * 10^`*exponent`. Returns number of digits.
+static size_t xml__shortest_digits(double value, char *digits, int *exponent) {
+  uint64_t bits;
+  memcpy(&bits, &value, sizeof(bits));
+  uint64_t mantissa = bits & ((1ull << 52) - 1);
+  int binary_exponent = (int)(bits >> 52 & 0x7ff);
+  if (binary_exponent) mantissa |= 1ull << 52;
+  binary_exponent = (binary_exponent ? binary_exponent : 1) - 1075;
+  // value = r / s, distances to the neighbours are m_minus / s and m_plus / s
+  XMLBig r, s, m_plus, m_minus;
+  bool uneven_gap = mantissa == 1ull << 52 && binary_exponent > -1074; // Lower neighbour is twice closer
+  xml__big_set(&r, mantissa);
+  xml__big_shift(&r, uneven_gap ? 2 : 1);
+  xml__big_set(&s, uneven_gap ? 4 : 2);
+  xml__big_set(&m_plus, uneven_gap ? 2 : 1);
+  xml__big_set(&m_minus, 1);
+  if (binary_exponent > 0) {
+    xml__big_shift(&r, binary_exponent);
+    xml__big_shift(&m_plus, binary_exponent);
+    xml__big_shift(&m_minus, binary_exponent);
+  } else {
+    xml__big_shift(&s, -binary_exponent);
+  }
+  // Estimate exponent from the highest bit. It's never too high, and one too low is fixed below.
+  int highest_bit = binary_exponent + 63;
+  while (!(mantissa >> (highest_bit - binary_exponent))) highest_bit--;
+  int k = (int)(highest_bit * 0.30102999566398114 + 0.99999999999);
+  if (highest_bit < 0) k = -(int)(-highest_bit * 0.30102999566398114);
+  if (k >= 0) {
+    xml__big_mul_pow10(&s, k);
+  } else {
+    xml__big_mul_pow10(&r, -k);
+    xml__big_mul_pow10(&m_plus, -k);
+    xml__big_mul_pow10(&m_minus, -k);
+  }
+  // Neighbours halfway between are read back as `value` only if it's mantissa is even (round half to even)
+  bool even = (mantissa & 1) == 0;
+  int high = xml__big_compare_sum(&r, &m_plus, &s);
+  if (even ? high >= 0 : high > 0) {
+    xml__big_mul(&s, 10);
+    k++;
+  }
+  size_t len = 0;
+  for (;;) {
+    xml__big_mul(&r, 10);
+    xml__big_mul(&m_plus, 10);
+    xml__big_mul(&m_minus, 10);
+    int digit = 0;
+    while (xml__big_compare(&r, &s) >= 0) {
+      xml__big_sub(&r, &s);
+      digit++;
     }
-    if (!found) {
-      XML_FREE(tokenized_path);
-      return NULL;
+    int low_cmp = xml__big_compare(&r, &m_minus), high_cmp = xml__big_compare_sum(&r, &m_plus, &s);
+    bool low = even ? low_cmp <= 0 : low_cmp < 0, up = even ? high_cmp >= 0 : high_cmp > 0;
+    if (!low && !up) {
+      digits[len++] = (char)('0' + digit);
+      continue;
     }
-    segment = strtok(NULL, "/");
+    // Last digit: round to the closer of the two candidates
+    if (low && up && xml__big_compare_sum(&r, &r, &s) >= 0) up = true;
+    else if (low) up = false;
+    digits[len++] = (char)('0' + digit + up);
+    break;
   }
-  XML_FREE(tokenized_path);
-  return current;
+  *exponent = k;
+  return len;
 }
 
-XML_H_API const char *xml_node_attr(XMLNode *node, const char *attr_key) {
-  if (!node || !attr_key) return NULL;
-  for (size_t i = 0; i < node->attrs->len; i++) {
-    XMLAttr *attr = (XMLAttr *)node->attrs->data[i];
-    if (attr->key && strcmp(attr->key, attr_key) == 0) return attr->value;
+// Write `digits` * 10^(`exponent` - `len`) like JavaScript numbers: plain notation for exponents from -5 to 21,
+// otherwise one digit before the point and `e` exponent. Returns length. Not NULL-terminated.
+static size_t xml__format_decimal(char *buf, bool negative, const char *digits, size_t len, int exponent) {
+  size_t out = 0;
+  if (negative) buf[out++] = '-';
+  if (exponent >= (int)len && exponent <= 21) {
+    // ddd000
+    memcpy(buf + out, digits, len);
+    out += len;
+    for (int i = (int)len; i < exponent; i++) buf[out++] = '0';
+  } else if (exponent > 0 && exponent <= 21) {
+    // dd.ddd
+    memcpy(buf + out, digits, exponent);
+    out += exponent;
+    buf[out++] = '.';
+    memcpy(buf + out, digits + exponent, len - exponent);
+    out += len - exponent;
+  } else if (exponent > -6 && exponent <= 0) {
+    // 0.00ddd
+    buf[out++] = '0';
+    buf[out++] = '.';
+    for (int i = exponent; i < 0; i++) buf[out++] = '0';
+    memcpy(buf + out, digits, len);
+    out += len;
+  } else {
+    // d.ddde+XX
+    buf[out++] = digits[0];
+    if (len > 1) {
+      buf[out++] = '.';
+      memcpy(buf + out, digits + 1, len - 1);
+      out += len - 1;
+    }
+    buf[out++] = 'e';
+    buf[out++] = exponent - 1 < 0 ? '-' : '+';
+    out += xml__format_uint64(buf + out, (uint64_t)(exponent - 1 < 0 ? 1 - exponent : exponent - 1));
   }
-  return NULL;
+  return out;
 }
 
-// Skip <!-- ... -->, <? ... ?>, <!DOCTYPE ... >
-// Returns true if skipped.
-static bool xml__skip_tags(const char *xml, size_t *idx) {
-  if (xml[*idx] == '!' || xml[*idx] == '?') {
-    size_t open_braket_count = 0;
-    while (xml[*idx] != '>' || (xml[*idx] == '>' && open_braket_count > 0)) {
-      if (xml[*idx] == '\0') return false;
-      if (xml[*idx] == '<') open_braket_count++;
-      if (xml[*idx] == '>') open_braket_count--;
-      (*idx)++;
-    }
-    (*idx)++; // Skip '>'
-    return true;
+// Write shortest decimal representation that reads back as the same `value`, independent of the locale.
+// Values with few decimal digits are written from an exact scaled integer, others with exact shortest digits.
+// Integral values are written as integers, infinities and NaN like in XML Schema: `INF`, `-INF`, `NaN`.
+// `buf` must be at least 32 bytes. Returns length. Not NULL-terminated.
+static size_t xml__format_double(char *buf, double value) {
+  if (value != value) return memcpy(buf, "NaN", 3), 3;
+  if (value - value != 0) return value > 0 ? (memcpy(buf, "INF", 3), 3) : (memcpy(buf, "-INF", 4), 4);
+  if (value == 0 && 1 / value < 0) return memcpy(buf, "-0", 2), 2;
+  if (value > -9007199254740992.0 && value < 9007199254740992.0 && value == (double)(int64_t)value)
+    return xml__format_int64(buf, (int64_t)value);
+  char digits[20];
+  size_t len;
+  int exponent;
+  // Few decimal digits: find smallest `scale` such that `value * 10^scale` is an exact integer mantissa.
+  // Both mantissa and 10^scale are exact doubles, so if division gives back `value` it reads back the same.
+  // Rounded product may be off by one from the exact one, so neighbours of the mantissa are tried too.
+  double magnitude = value < 0 ? -value : value, pow10 = 1;
+  for (int scale = 1; scale <= 15 && magnitude < 1e15; scale++) {
+    pow10 *= 10;
+    double scaled = magnitude * pow10;
+    if (scaled >= 9007199254740992.0) break;
+    uint64_t rounded = (uint64_t)(scaled + 0.5), mantissa = 0;
+    uint64_t candidates[3] = {rounded, rounded + 1, rounded ? rounded - 1 : 0};
+    for (int i = 0; i < 3 && !mantissa; i++)
+      if (candidates[i] && candidates[i] < (1ull << 53) && (double)candidates[i] / pow10 == magnitude)
+        mantissa = candidates[i];
+    if (!mantissa) continue;
+    size_t digits_len = xml__format_uint64(digits, mantissa);
+    for (len = digits_len; digits[len - 1] == '0';) len--;
+    return xml__format_decimal(buf, value < 0, digits, len, (int)digits_len - scale);
   }
-  return false;
+  len = xml__shortest_digits(magnitude, digits, &exponent);
+  return xml__format_decimal(buf, value < 0, digits, len, exponent);
 }
 
-// Parse end tag </tag>.
-static void xml__parse_end_tag(const char *xml, size_t *idx, XMLNode **curr_node) {
-  (*idx)++; // Skip '/'
-  xml__skip_whitespace(xml, idx);
-  while (xml[*idx] != '>' && xml[*idx] != '\0') (*idx)++;
-  if (xml[*idx] == '>') (*idx)++; // Skip '>'
-  *curr_node = (*curr_node)->parent;
+XML_H_API void xml_string_append_uint64(XMLString *str, uint64_t value) {
+  if (!str) return;
+  xml__string_reserve(str, 20);
+  str->len += xml__format_uint64(str->str + str->len, value);
+  str->str[str->len] = '\0';
 }
 
-// Parse tag name <name ... >
-static void xml__parse_tag_name(const char *xml, size_t *idx, XMLNode **curr_node) {
-  size_t tag_start = *idx;
-  while (!(isspace(xml[*idx]) || xml[*idx] == '>' || xml[*idx] == '/') && xml[*idx] != '\0') (*idx)++;
-  (*curr_node)->tag = xml__strndup(xml + tag_start, *idx - tag_start);
+XML_H_API void xml_string_append_int64(XMLString *str, int64_t value) {
+  if (!str) return;
+  xml__string_reserve(str, 21);
+  str->len += xml__format_int64(str->str + str->len, value);
+  str->str[str->len] = '\0';
 }
 
-// Parse tag attributes <tag attr="value" ... >
-static void xml__parse_tag_attributes(const char *xml, size_t *idx, XMLNode **curr_node) {
-  xml__skip_whitespace(xml, idx);
-  while (xml[*idx] != '\0' && !(xml[*idx] == '>' || xml[*idx] == '/')) {
-    size_t attr_start = *idx;
-    while (xml[*idx] != '\0' && xml[*idx] != '=' && !isspace(xml[*idx])) (*idx)++;
-    if (*idx == attr_start) {
-      while (xml[*idx] != '\0' && xml[*idx] != '>' && xml[*idx] != '/') { (*idx)++; }
-      break;
-    }
-    size_t attr_len = *idx - attr_start;
-    char attr_key[attr_len + 1];
-    strncpy(attr_key, xml + attr_start, attr_len);
-    attr_key[attr_len] = '\0';
-    xml__skip_whitespace(xml, idx);
-    if (xml[*idx] != '=') break;
+XML_H_API void xml_string_append_double(XMLString *str, double value) {
+  if (!str) return;
+  xml__string_reserve(str, 32);
+  str->len += xml__format_double(str->str + str->len, value);
+  str->str[str->len] = '\0';
+}
+
+XML_H_API void xml_string_free(XMLString *str) {
+  if (!str) return;
+  const XMLAllocator *allocator = str->allocator;
+  XML_FREE(allocator, str->str);
+  XML_FREE(allocator, str);
+}
+
+XML_H_API char *xml_string_steal(XMLString *str) {
+  if (!str) return NULL;
+  char *stealed = str->str;
+  XML_FREE(str->allocator, str);
+  return stealed;
+}
+
+XML_H_API void xml_string_reserve(XMLString *str, size_t size) {
+  if (!str || size <= str->size) return;
+  str->size = size;
+  str->str = (char *)xml__realloc(str->allocator, str->str, str->size);
+}
+
+XML_H_API void xml_string_clear(XMLString *str) {
+  if (!str) return;
+  str->len = 0;
+  str->str[0] = '\0';
+}
+
+XML_H_API void xml_string_reset(XMLString *str, size_t max_size) {
+  if (!str) return;
+  if (max_size == 0) max_size = 1;
+  if (str->size > max_size) {
+    str->size = max_size;
+    str->str = (char *)xml__realloc(str->allocator, str->str, str->size);
+  }
+  xml_string_clear(str);
+}
+
+// ---------- XMLString pool ---------- //
+
+#define XML__STRING_POOL_SIZE 8 // Max number of strings kept by every thread
+
+typedef struct {
+  XMLString *strings[XML__STRING_POOL_SIZE]; // Released strings
+  size_t len;                                // Number of released strings
+  size_t size_hint;                          // Learned size of the output
+} XMLStringPool;
+
+static XML__THREAD_LOCAL XMLStringPool xml__string_pool;
+
+#ifndef XML_NO_THREADS
+static pthread_once_t xml__string_pool_once = PTHREAD_ONCE_INIT;
+static pthread_key_t xml__string_pool_key;
+
+// Free strings of the exiting thread.
+static void xml__string_pool_destroy(void *ptr) {
+  XMLStringPool *pool = (XMLStringPool *)ptr;
+  while (pool->len > 0) xml_string_free(pool->strings[--pool->len]);
+}
+
+static void xml__string_pool_key_create() { pthread_key_create(&xml__string_pool_key, xml__string_pool_destroy); }
+#endif // XML_NO_THREADS
+
+XML_H_API XMLString *xml_string_acquire() {
+  XMLStringPool *pool = &xml__string_pool;
+  if (pool->len > 0) return pool->strings[--pool->len];
+  XMLString *str = xml_string_new();
+  if (!str) return NULL;
+  // Headroom for outputs slightly bigger than before
+  xml_string_reserve(str, pool->size_hint + pool->size_hint / 4 + 1);
+  return str;
+}
+
+XML_H_API void xml_string_release(XMLString *str) {
+  if (!str) return;
+  XMLStringPool *pool = &xml__string_pool;
+  if (str->allocator || pool->len == XML__STRING_POOL_SIZE) {
+    xml_string_free(str);
+    return;
+  }
+#ifndef XML_NO_THREADS
+  if (pool->size_hint == 0) {
+    // First use on this thread: make sure strings are freed when it exits
+    pthread_once(&xml__string_pool_once, xml__string_pool_key_create);
+    pthread_setspecific(xml__string_pool_key, pool);
+  }
+#endif // XML_NO_THREADS
+  // Follow growth at once, shrink slowly
+  if (str->len + 1 > pool->size_hint) pool->size_hint = str->len + 1;
+  else pool->size_hint -= (pool->size_hint - str->len - 1) / 16;
+  // Don't keep occasional huge buffers
+  xml_string_reset(str, pool->size_hint * 4);
+  pool->strings[pool->len++] = str;
+}
+
+// ---------- XMLList ---------- //
+
+// Create new dynamic array
+XML_H_API XMLList *xml_list_new() { return xml_list_new_with_allocator(NULL); }
+
+XML_H_API XMLList *xml_list_new_with_allocator(const XMLAllocator *allocator) {
+  XMLList *list = (XMLList *)xml__calloc(allocator, 1, sizeof(XMLList));
+  list->allocator = allocator;
+  list->len = 0;
+  list->size = 32;
+  list->data = (void **)xml__calloc(allocator, 1, sizeof(void *) * list->size);
+  return list;
+}
+
+XML_H_API void xml_list_reserve(XMLList *list, size_t size) {
+  if (!list || size <= list->size) return;
+  if (list->borrowed) {
+    // Move data out of the compacted block
+    void **owned = (void **)xml__calloc(list->allocator, size, sizeof(void *));
+    if (list->len) memcpy(owned, list->data, list->len * sizeof(void *));
+    list->data = owned;
+    list->borrowed = false;
+  } else list->data = (void **)xml__realloc(list->allocator, list->data, size * sizeof(void *));
+  list->size = size;
+}
+
+// Add element to the end of the array. Grow if needed.
+XML_H_API void xml_list_add(XMLList *list, void *data) {
+  if (!list || !data) return;
+  if (list->len >= list->size) xml_list_reserve(list, list->size ? list->size * 2 : 32);
+  list->data[list->len++] = data;
+}
+
+// ---------- XMLNode ---------- //
+
+// Mark the compacted block containing `node` as edited, so it's not freed at once.
+// Atomic, because readers of shared documents mark blocks when they build children indexes.
+static void xml__mark_edited(XMLNode *node) {
+  while (node && (XML__ATOMIC_LOAD_RELAXED(&node->flags) & XML__NODE_BORROWED)) node = node->parent;
+  if (node && (XML__ATOMIC_LOAD_RELAXED(&node->flags) & XML__LISTS_BORROWED))
+    XML__ATOMIC_OR(&node->flags, XML__BLOCK_EDITED);
+}
+
+// Check if node owns a compacted block that has only compacted nodes inside it.
+// Flags are loaded atomically, as readers of shared documents may set `XML__BLOCK_EDITED` meanwhile.
+static inline bool xml__is_pristine_block(XMLNode *node) {
+  unsigned flags = XML__ATOMIC_LOAD_RELAXED(&node->flags);
+  return (flags & (XML__NODE_BORROWED | XML__LISTS_BORROWED | XML__BLOCK_EDITED)) == XML__LISTS_BORROWED;
+}
+
+// Store string according to `mode`. Sets `borrowed_flag` in `flags` if string is not owned.
+static inline char *xml__store_string(const XMLAllocator *allocator, const char *str, XMLStrMode mode,
+                                      unsigned borrowed_flag, unsigned *flags) {
+  if (!str) return NULL;
+  if (mode == XML_STR_COPY) return xml__strdup(allocator, str);
+  if (mode == XML_STR_STATIC) *flags |= borrowed_flag;
+  return (char *)str;
+}
+
+// FNV-1a hash of the string.
+static inline uint64_t xml__hash(const char *str) {
+  uint64_t hash = 14695981039346656037ull;
+  for (; *str; str++) hash = (hash ^ (unsigned char)*str) * 1099511628211ull;
+  return hash;
+}
+
+// FNV-1a hash of `len` bytes of the string.
+static inline uint64_t xml__hash_n(const char *str, size_t len) {
+  uint64_t hash = 14695981039346656037ull;
+  for (size_t i = 0; i < len; i++) hash = (hash ^ (unsigned char)str[i]) * 1099511628211ull;
+  return hash;
+}
+
+// ---------- Tag filters ---------- //
+
+// Bloom filter bits of the tag name.
+static inline uint64_t xml__tag_bits(const char *tag) {
+  if (!tag) return 0;
+  uint64_t hash = xml__hash(tag);
+  return (1ull << (hash & 63)) | (1ull << ((hash >> 6) & 63));
+}
+
+// Add tag bits to the node and all it's ancestors. Stops at the first ancestor that already has them.
+static inline void xml__tag_filter_add(XMLNode *node, uint64_t bits) {
+  for (; node && (node->tag_filter & bits) != bits; node = node->parent) node->tag_filter |= bits;
+}
+
+XML_H_API void xml_node_update_tag_filters(XMLNode *node) {
+  if (!node) return;
+  node->tag_filter = xml__tag_bits(node->tag);
+  for (size_t i = 0; i < node->children->len; i++) {
+    XMLNode *child = (XMLNode *)node->children->data[i];
+    xml_node_update_tag_filters(child);
+    node->tag_filter |= child->tag_filter;
+  }
+}
+
+// ---------- Order numbering ---------- //
+
+static size_t xml__order_stamp = 0; // Last used numbering pass
+
+static inline XMLNode *xml__root(XMLNode *node) {
+  while (node->parent) node = node->parent;
+  return node;
+}
+
+// Invalidate numbering of the node and all it's ancestors. Stops at the first ancestor that is already invalid.
+static inline void xml__order_invalidate(XMLNode *node) {
+  for (; node && node->order_stamp; node = node->parent) node->order_stamp = 0;
+}
+
+// Number subtree in pre-order starting from `order`. Returns next free order.
+static size_t xml__order_number(XMLNode *node, size_t order, size_t stamp) {
+  node->order = order++;
+  node->order_stamp = stamp;
+  for (size_t i = 0; i < node->children->len; i++)
+    order = xml__order_number((XMLNode *)node->children->data[i], order, stamp);
+  node->subtree_size = order - node->order;
+  return order;
+}
+
+XML_H_API void xml_node_update_order(XMLNode *node) {
+  if (!node) return;
+  xml__order_number(xml__root(node), 0, XML__ATOMIC_ADD(&xml__order_stamp, 1));
+}
+
+// Make sure both nodes are numbered. Returns false if they are in different trees.
+// Nodes of different trees don't renumber anything: frozen documents are numbered once when frozen
+// and may be read by other threads, so they must never be written to here.
+static bool xml__order_ensure(XMLNode *a, XMLNode *b) {
+  if (a->order_stamp && a->order_stamp == b->order_stamp) return true;
+  XMLNode *root = xml__root(a);
+  if (root != xml__root(b)) return false;
+  xml__order_number(root, 0, XML__ATOMIC_ADD(&xml__order_stamp, 1));
+  return true;
+}
+
+XML_H_API bool xml_node_is_ancestor(XMLNode *ancestor, XMLNode *node) {
+  if (!ancestor || !node || !xml__order_ensure(ancestor, node)) return false;
+  return ancestor->order < node->order && node->order < ancestor->order + ancestor->subtree_size;
+}
+
+XML_H_API int xml_node_compare_order(XMLNode *a, XMLNode *b) {
+  if (!a || !b || a == b || !xml__order_ensure(a, b)) return 0;
+  return a->order < b->order ? -1 : 1;
+}
+
+XML_H_API size_t xml_node_descendants_count(XMLNode *node) {
+  if (!node) return 0;
+  if (!node->order_stamp) xml_node_update_order(node);
+  return node->subtree_size - 1;
+}
+
+// ---------- Attribute index ---------- //
+
+typedef struct {
+  uint64_t hash;     // Hash of the value
+  const char *value; // Attribute value, points into the node's attribute. NULL for empty slot.
+  XMLNode *node;     // Node with the attribute
+} XMLAttrIndexEntry;
+
+// Open addressing hash table of attribute values.
+typedef struct XMLAttrIndex {
+  char *key;                  // Indexed attribute key
+  XMLAttrIndexEntry *entries; // Slots. Number of slots is a power of two.
+  size_t len;                 // Number of used slots
+  size_t size;                // Number of slots
+  struct XMLAttrIndex *next;  // Index of the next key
+} XMLAttrIndex;
+
+// Find slot of the value or empty slot where it should be inserted.
+static inline XMLAttrIndexEntry *xml__attr_index_slot(XMLAttrIndex *index, const char *value, uint64_t hash) {
+  size_t mask = index->size - 1;
+  for (size_t i = hash & mask;; i = (i + 1) & mask) {
+    XMLAttrIndexEntry *entry = &index->entries[i];
+    if (!entry->value || (entry->hash == hash && strcmp(entry->value, value) == 0)) return entry;
+  }
+}
+
+// Insert value unless it's already indexed. Returns false for error.
+static bool xml__attr_index_insert(XMLAttrIndex *index, const XMLAllocator *allocator, const char *value,
+                                   XMLNode *node) {
+  // Keep load factor under 3/4
+  if ((index->len + 1) * 4 > index->size * 3) {
+    size_t size = index->size ? index->size * 2 : 16;
+    XMLAttrIndexEntry *entries = (XMLAttrIndexEntry *)xml__calloc(allocator, size, sizeof(XMLAttrIndexEntry));
+    if (!entries) return false;
+    XMLAttrIndexEntry *old = index->entries;
+    size_t old_size = index->size;
+    index->entries = entries;
+    index->size = size;
+    for (size_t i = 0; i < old_size; i++)
+      if (old[i].value) *xml__attr_index_slot(index, old[i].value, old[i].hash) = old[i];
+    XML_FREE(allocator, old);
+  }
+  uint64_t hash = xml__hash(value);
+  XMLAttrIndexEntry *entry = xml__attr_index_slot(index, value, hash);
+  if (entry->value) return true;
+  entry->hash = hash;
+  entry->value = value;
+  entry->node = node;
+  index->len++;
+  return true;
+}
+
+// Index attributes of the node if it has indexed key.
+static bool xml__attr_index_node(XMLAttrIndex *indexes, const XMLAllocator *allocator, XMLNode *node) {
+  for (size_t i = 0; i < node->attrs->len; i++) {
+    XMLAttr *attr = (XMLAttr *)node->attrs->data[i];
+    for (XMLAttrIndex *index = indexes; index; index = index->next)
+      if (strcmp(index->key, attr->key) == 0 && !xml__attr_index_insert(index, allocator, attr->value, node))
+        return false;
+  }
+  return true;
+}
+
+// Index the subtree in document order.
+static bool xml__attr_index_tree(XMLAttrIndex *indexes, const XMLAllocator *allocator, XMLNode *node) {
+  if (!xml__attr_index_node(indexes, allocator, node)) return false;
+  for (size_t i = 0; i < node->children->len; i++)
+    if (!xml__attr_index_tree(indexes, allocator, (XMLNode *)node->children->data[i])) return false;
+  return true;
+}
+
+static void xml__attr_index_free(XMLNode *root) {
+  XMLAttrIndex *index = root->attr_index;
+  while (index) {
+    XMLAttrIndex *next = index->next;
+    XML_FREE(root->allocator, index->entries);
+    XML_FREE(root->allocator, index->key);
+    XML_FREE(root->allocator, index);
+    index = next;
+  }
+  root->attr_index = NULL;
+}
+
+// Point nodes of the subtree to the root of their indexes (NULL if the tree isn't indexed).
+static void xml__attr_index_set_root(XMLNode *node, XMLNode *root) {
+  node->index_root = root;
+  for (size_t i = 0; i < node->children->len; i++)
+    xml__attr_index_set_root((XMLNode *)node->children->data[i], root);
+}
+
+// Rebuild all indexes of the root from scratch.
+static bool xml__attr_index_rebuild(XMLNode *root) {
+  for (XMLAttrIndex *index = root->attr_index; index; index = index->next) {
+    memset(index->entries, 0, index->size * sizeof(XMLAttrIndexEntry));
+    index->len = 0;
+  }
+  return xml__attr_index_tree(root->attr_index, root->allocator, root);
+}
+
+XML_H_API bool xml_node_index_attr(XMLNode *node, const char *key) {
+  if (!node || !key) return false;
+  XMLNode *root = node->index_root ? node->index_root : xml__root(node);
+  for (XMLAttrIndex *index = root->attr_index; index; index = index->next)
+    if (strcmp(index->key, key) == 0) return true;
+  XMLAttrIndex *index = (XMLAttrIndex *)xml__calloc(root->allocator, 1, sizeof(XMLAttrIndex));
+  if (!index) return false;
+  index->key = xml__strdup(root->allocator, key);
+  if (!index->key || !xml__attr_index_tree(index, root->allocator, root)) {
+    XML_FREE(root->allocator, index->entries);
+    XML_FREE(root->allocator, index->key);
+    XML_FREE(root->allocator, index);
+    return false;
+  }
+  index->next = root->attr_index;
+  root->attr_index = index;
+  if (!root->index_root) xml__attr_index_set_root(root, root);
+  return true;
+}
+
+XML_H_API XMLNode *xml_node_lookup(XMLNode *node, const char *key, const char *value) {
+  if (!node || !key || !value || !node->index_root) return NULL;
+  for (XMLAttrIndex *index = node->index_root->attr_index; index; index = index->next) {
+    if (strcmp(index->key, key) != 0) continue;
+    if (!index->len) return NULL;
+    return xml__attr_index_slot(index, value, xml__hash(value))->node;
+  }
+  return NULL;
+}
+
+// ---------- Children index ---------- //
+
+#define XML__CHILD_INDEX_MIN 16 // Nodes with fewer children are searched linearly
+#define XML__CHILD_NONE SIZE_MAX
+
+typedef struct {
+  uint64_t hash; // Hash of the tag name
+  size_t first;  // Position of the first child with the tag. XML__CHILD_NONE for empty slot.
+  size_t last;   // Position of the last child with the tag
+} XMLChildIndexEntry;
+
+// Open addressing hash table of children tag names with chains of children having the same tag.
+// Stores positions instead of pointers, so relocated children don't invalidate it.
+typedef struct XMLChildIndex {
+  XMLChildIndexEntry *entries; // Slots. Number of slots is a power of two.
+  size_t entries_len;          // Number of used slots
+  size_t entries_size;         // Number of slots
+  size_t *next;                // Position of the next child with the same tag for every child or XML__CHILD_NONE
+  size_t len;                  // Number of indexed children
+  size_t size;                 // Capacity of `next`
+} XMLChildIndex;
+
+// Find slot of the tag or empty slot where it should be inserted.
+static inline XMLChildIndexEntry *xml__child_index_slot(XMLChildIndex *index, XMLNode *node, const char *tag,
+                                                        uint64_t hash) {
+  size_t mask = index->entries_size - 1;
+  for (size_t i = hash & mask;; i = (i + 1) & mask) {
+    XMLChildIndexEntry *entry = &index->entries[i];
+    if (entry->first == XML__CHILD_NONE) return entry;
+    if (entry->hash == hash && strcmp(((XMLNode *)node->children->data[entry->first])->tag, tag) == 0) return entry;
+  }
+}
+
+// Resize hash table to `size` slots. Returns false for error.
+static bool xml__child_index_resize(XMLChildIndex *index, XMLNode *node, size_t size) {
+  XMLChildIndexEntry *entries = (XMLChildIndexEntry *)xml__calloc(node->allocator, size, sizeof(XMLChildIndexEntry));
+  if (!entries) return false;
+  for (size_t i = 0; i < size; i++) entries[i].first = XML__CHILD_NONE;
+  XMLChildIndexEntry *old = index->entries;
+  size_t old_size = index->entries_size;
+  index->entries = entries;
+  index->entries_size = size;
+  for (size_t i = 0; i < old_size; i++) {
+    if (old[i].first == XML__CHILD_NONE) continue;
+    const char *tag = ((XMLNode *)node->children->data[old[i].first])->tag;
+    *xml__child_index_slot(index, node, tag, old[i].hash) = old[i];
+  }
+  XML_FREE(node->allocator, old);
+  return true;
+}
+
+// Index children appended after the last update. Returns false for error.
+static bool xml__child_index_update(XMLChildIndex *index, XMLNode *node) {
+  size_t len = node->children->len;
+  if (len > index->size) {
+    size_t size = index->size ? index->size : XML__CHILD_INDEX_MIN;
+    while (size < len) size *= 2;
+    size_t *next = (size_t *)xml__realloc(node->allocator, index->next, size * sizeof(size_t));
+    if (!next) return false;
+    index->next = next;
+    index->size = size;
+  }
+  for (size_t pos = index->len; pos < len; pos++) {
+    const char *tag = ((XMLNode *)node->children->data[pos])->tag;
+    index->next[pos] = XML__CHILD_NONE;
+    index->len = pos + 1;
+    if (!tag) continue;
+    // Keep load factor under 3/4
+    if ((index->entries_len + 1) * 4 > index->entries_size * 3 &&
+        !xml__child_index_resize(index, node, index->entries_size ? index->entries_size * 2 : 16)) {
+      index->len = pos;
+      return false;
+    }
+    uint64_t hash = xml__hash(tag);
+    XMLChildIndexEntry *entry = xml__child_index_slot(index, node, tag, hash);
+    if (entry->first == XML__CHILD_NONE) {
+      entry->hash = hash;
+      entry->first = pos;
+      index->entries_len++;
+    } else index->next[entry->last] = pos;
+    entry->last = pos;
+  }
+  return true;
+}
+
+static void xml__child_index_free(const XMLAllocator *allocator, XMLChildIndex *index) {
+  if (!index) return;
+  XML_FREE(allocator, index->entries);
+  XML_FREE(allocator, index->next);
+  XML_FREE(allocator, index);
+}
+
+// Get up to date children index of the node. Returns NULL for error.
+static XMLChildIndex *xml__child_index(XMLNode *node) {
+  XMLChildIndex *index = XML__ATOMIC_LOAD(&node->child_index);
+  if (index) {
+    // Shared documents are never edited, so only the owner of the tree can get here
+    if (index->len != node->children->len && !xml__child_index_update(index, node)) return NULL;
+    return index;
+  }
+  index = (XMLChildIndex *)xml__calloc(node->allocator, 1, sizeof(XMLChildIndex));
+  if (!index || !xml__child_index_update(index, node)) {
+    xml__child_index_free(node->allocator, index);
+    return NULL;
+  }
+  // Index lives outside of the compacted block
+  xml__mark_edited(node);
+  // Other reader of shared document could build it at the same time, use the first one
+  XMLChildIndex *expected = NULL;
+  if (!XML__ATOMIC_CAS(&node->child_index, &expected, index)) {
+    xml__child_index_free(node->allocator, index);
+    return expected;
+  }
+  return index;
+}
+
+// Search children linearly starting from `*iter`.
+static XMLNode *xml__children_by_tag_scan(XMLNode *node, const char *name, size_t *iter) {
+  for (size_t pos = *iter; pos < node->children->len; pos++) {
+    XMLNode *child = (XMLNode *)node->children->data[pos];
+    if (child->tag && strcmp(child->tag, name) == 0) {
+      *iter = pos + 1;
+      return child;
+    }
+  }
+  *iter = node->children->len;
+  return NULL;
+}
+
+XML_H_API XMLNode *xml_node_children_by_tag(XMLNode *node, const char *name, size_t *iter) {
+  if (!node || !name || !iter || *iter >= node->children->len) return NULL;
+  if (node->children->len < XML__CHILD_INDEX_MIN) return xml__children_by_tag_scan(node, name, iter);
+  XMLChildIndex *index = xml__child_index(node);
+  if (!index) return xml__children_by_tag_scan(node, name, iter);
+  size_t pos;
+  if (*iter == 0)
+    pos = index->entries_len ? xml__child_index_slot(index, node, name, xml__hash(name))->first : XML__CHILD_NONE;
+  else pos = index->next[*iter - 1];
+  if (pos == XML__CHILD_NONE) {
+    *iter = node->children->len;
+    return NULL;
+  }
+  *iter = pos + 1;
+  return (XMLNode *)node->children->data[pos];
+}
+
+XML_H_API XMLNode *xml_node_child_by_tag(XMLNode *node, const char *name) {
+  size_t iter = 0;
+  return xml_node_children_by_tag(node, name, &iter);
+}
+
+static XMLNode *xml__node_new(XMLNode *parent, const char *tag, XMLStrMode tag_mode, const char *inner_text,
+                              XMLStrMode text_mode, const XMLAllocator *allocator) {
+  if (parent) allocator = parent->allocator;
+  XMLNode *node = (XMLNode *)xml__calloc(allocator, 1, sizeof(XMLNode));
+  node->allocator = allocator;
+  node->parent = parent;
+  node->tag = xml__store_string(allocator, tag, tag_mode, XML__TAG_BORROWED, &node->flags);
+  node->text = xml__store_string(allocator, inner_text, text_mode, XML__TEXT_BORROWED, &node->flags);
+  node->children = xml_list_new_with_allocator(allocator);
+  node->attrs = xml_list_new_with_allocator(allocator);
+  node->tag_filter = xml__tag_bits(node->tag);
+  if (parent) {
+    node->index_root = parent->index_root;
+    xml__mark_edited(parent);
+    xml_list_add(parent->children, node);
+    xml__tag_filter_add(parent, node->tag_filter);
+    xml__order_invalidate(parent);
+  }
+  return node;
+}
+
+XML_H_API XMLNode *xml_node_new(XMLNode *parent, const char *tag, const char *inner_text) {
+  return xml__node_new(parent, tag, XML_STR_COPY, inner_text, XML_STR_COPY, NULL);
+}
+
+XML_H_API XMLNode *xml_node_new_with_allocator(XMLNode *parent, const char *tag, const char *inner_text,
+                                               const XMLAllocator *allocator) {
+  return xml__node_new(parent, tag, XML_STR_COPY, inner_text, XML_STR_COPY, allocator);
+}
+
+XML_H_API XMLNode *xml_node_new_static(XMLNode *parent, const char *tag, const char *inner_text) {
+  return xml__node_new(parent, tag, XML_STR_STATIC, inner_text, XML_STR_STATIC, NULL);
+}
+
+XML_H_API XMLNode *xml_node_new_ex(XMLNode *parent, const char *tag, XMLStrMode tag_mode, const char *inner_text,
+                                   XMLStrMode text_mode) {
+  return xml__node_new(parent, tag, tag_mode, inner_text, text_mode, NULL);
+}
+
+// Free string passed with XML_STR_TAKE that is not going to be stored.
+static inline void xml__string_drop(const XMLAllocator *allocator, const char *str, XMLStrMode mode) {
+  char *owned = (char *)str;
+  if (mode == XML_STR_TAKE) XML_FREE(allocator, owned);
+}
+
+// Add attribute without updating attribute indexes.
+static XMLAttr *xml__node_add_attr(XMLNode *node, const char *key, XMLStrMode key_mode, const char *value,
+                                   XMLStrMode value_mode) {
+  XMLAttr *attr = key && value ? (XMLAttr *)xml__calloc(node->allocator, 1, sizeof(XMLAttr)) : NULL;
+  if (!attr) {
+    xml__string_drop(node->allocator, key, key_mode);
+    xml__string_drop(node->allocator, value, value_mode);
+    return NULL;
+  }
+  xml__mark_edited(node);
+  attr->key = xml__store_string(node->allocator, key, key_mode, XML__KEY_BORROWED, &attr->flags);
+  attr->value = xml__store_string(node->allocator, value, value_mode, XML__VALUE_BORROWED, &attr->flags);
+  xml_list_add(node->attrs, attr);
+  return attr;
+}
+
+XML_H_API void xml_node_add_attr_ex(XMLNode *node, const char *key, XMLStrMode key_mode, const char *value,
+                                    XMLStrMode value_mode) {
+  if (!node) return;
+  XMLAttr *attr = xml__node_add_attr(node, key, key_mode, value, value_mode);
+  if (!attr || !node->index_root) return;
+  XMLNode *root = node->index_root;
+  for (XMLAttrIndex *index = root->attr_index; index; index = index->next)
+    if (strcmp(index->key, attr->key) == 0) xml__attr_index_insert(index, root->allocator, attr->value, node);
+}
+
+// Copy formatted number of `len` bytes from `buf` into node's storage.
+static inline char *xml__node_number(XMLNode *node, const char *buf, size_t len) {
+  return xml__strndup(node->allocator, buf, len);
+}
+
+XML_H_API void xml_node_add_attr_int64(XMLNode *node, const char *key, int64_t value) {
+  if (!node || !key) return;
+  char buf[21];
+  size_t len = xml__format_int64(buf, value);
+  xml_node_add_attr_ex(node, key, XML_STR_COPY, xml__node_number(node, buf, len), XML_STR_TAKE);
+}
+
+XML_H_API void xml_node_add_attr_uint64(XMLNode *node, const char *key, uint64_t value) {
+  if (!node || !key) return;
+  char buf[20];
+  size_t len = xml__format_uint64(buf, value);
+  xml_node_add_attr_ex(node, key, XML_STR_COPY, xml__node_number(node, buf, len), XML_STR_TAKE);
+}
+
+XML_H_API void xml_node_add_attr_double(XMLNode *node, const char *key, double value) {
+  if (!node || !key) return;
+  char buf[32];
+  size_t len = xml__format_double(buf, value);
+  xml_node_add_attr_ex(node, key, XML_STR_COPY, xml__node_number(node, buf, len), XML_STR_TAKE);
+}
+
+// Replace node's text with owned `text`.
+static void xml__node_set_text_take(XMLNode *node, char *text) {
+  xml__mark_edited(node);
+  if (!(node->flags & XML__TEXT_BORROWED)) XML_FREE(node->allocator, node->text);
+  node->flags &= ~XML__TEXT_BORROWED;
+  node->text = text;
+}
+
+XML_H_API void xml_node_set_text(XMLNode *node, const char *text) {
+  if (node) xml__node_set_text_take(node, text ? xml__strdup(node->allocator, text) : NULL);
+}
+
+XML_H_API void xml_node_set_text_int64(XMLNode *node, int64_t value) {
+  if (!node) return;
+  char buf[21];
+  xml__node_set_text_take(node, xml__node_number(node, buf, xml__format_int64(buf, value)));
+}
+
+XML_H_API void xml_node_set_text_uint64(XMLNode *node, uint64_t value) {
+  if (!node) return;
+  char buf[20];
+  xml__node_set_text_take(node, xml__node_number(node, buf, xml__format_uint64(buf, value)));
+}
+
+XML_H_API void xml_node_set_text_double(XMLNode *node, double value) {
+  if (!node) return;
+  char buf[32];
+  xml__node_set_text_take(node, xml__node_number(node, buf, xml__format_double(buf, value)));
+}
+
+XML_H_API void xml_node_add_attrs(XMLNode *node, const char *const *keys, const char *const *values, size_t n) {
+  if (!node || !keys || !values) return;
+  xml_list_reserve(node->attrs, node->attrs->len + n);
+  for (size_t i = 0; i < n; i++) xml_node_add_attr_ex(node, keys[i], XML_STR_COPY, values[i], XML_STR_COPY);
+}
+
+XML_H_API void xml_node_reserve_attrs(XMLNode *node, size_t n) {
+  if (node) xml_list_reserve(node->attrs, n);
+}
+
+XML_H_API void xml_node_reserve_children(XMLNode *node, size_t n) {
+  if (node) xml_list_reserve(node->children, n);
+}
+
+XML_H_API size_t xml_node_append_children(XMLNode *node, XMLNode *const *nodes, size_t n) {
+  if (!node || !nodes) return 0;
+  xml__mark_edited(node);
+  xml__order_invalidate(node);
+  xml_list_reserve(node->children, node->children->len + n);
+  XMLNode *root = node->index_root;
+  // Appending it would make a cycle
+  XMLNode *own_root = xml__root(node);
+  size_t added = 0;
+  for (size_t i = 0; i < n; i++) {
+    if (!nodes[i] || nodes[i]->parent || nodes[i] == own_root) continue;
+    // Indexes of the appended tree are replaced with the indexes of this one
+    xml__attr_index_free(nodes[i]);
+    if (nodes[i]->index_root != root) xml__attr_index_set_root(nodes[i], root);
+    nodes[i]->parent = node;
+    node->children->data[node->children->len++] = nodes[i];
+    xml__tag_filter_add(node, nodes[i]->tag_filter);
+    if (root) xml__attr_index_tree(root->attr_index, root->allocator, nodes[i]);
+    added++;
+  }
+  return added;
+}
+
+XML_H_API void xml_node_add_attr(XMLNode *node, const char *key, const char *value) {
+  xml_node_add_attr_ex(node, key, XML_STR_COPY, value, XML_STR_COPY);
+}
+
+XML_H_API void xml_node_add_attr_static(XMLNode *node, const char *key, const char *value) {
+  xml_node_add_attr_ex(node, key, XML_STR_STATIC, value, XML_STR_STATIC);
+}
+
+XML_H_API void xml_node_add_attr_take(XMLNode *node, char *key, char *value) {
+  xml_node_add_attr_ex(node, key, XML_STR_TAKE, value, XML_STR_TAKE);
+}
+
+XML_H_API XMLNode *xml_node_child_at(XMLNode *node, size_t index) {
+  if (!node || !node->children) return NULL;
+  if (index >= node->children->len) return NULL;
+  return (XMLNode *)node->children->data[index];
+}
+
+// Search tag by exact name, skipping subtrees that can't contain it.
+static XMLNode *xml__find_tag_exact(XMLNode *node, const char *tag, uint64_t bits) {
+  if ((node->tag_filter & bits) != bits) return NULL;
+  if (node->tag && strcmp(node->tag, tag) == 0) return node;
+  for (size_t i = 0; i < node->children->len; i++) {
+    XMLNode *result = xml__find_tag_exact((XMLNode *)node->children->data[i], tag, bits);
+    if (result) return result;
+  }
+  return NULL;
+}
+
+// Search tag by part of it's name. Filters can't skip subtrees here.
+static XMLNode *xml__find_tag_partial(XMLNode *node, const char *tag) {
+  if (node->tag && strstr(node->tag, tag) != NULL) return node;
+  for (size_t i = 0; i < node->children->len; i++) {
+    XMLNode *result = xml__find_tag_partial((XMLNode *)node->children->data[i], tag);
+    if (result) return result;
+  }
+  return NULL;
+}
+
+XML_H_API XMLNode *xml_node_find_tag(XMLNode *node, const char *tag, bool exact) {
+  if (!node || !tag) return NULL;
+  // If tag doesn't contain any '/' then it's a single tag search
+  if (!strchr(tag, '/')) {
+    if (!exact) return xml__find_tag_partial(node, tag);
+    // Empty filter means the tree wasn't built by the library functions, search it without skipping
+    return xml__find_tag_exact(node, tag, node->tag_filter ? xml__tag_bits(tag) : 0);
+  }
+  // Path tag search
+  char *tokenized_path = xml__strdup(node->allocator, tag);
+  if (!tokenized_path) return NULL;
+  // Split in place instead of strtok(), which keeps hidden state shared between threads
+  char *segment = tokenized_path;
+  XMLNode *current = node;
+  while (current) {
+    while (*segment == '/') segment++;
+    if (!*segment) break;
+    char *end = segment + strcspn(segment, "/");
+    char *next = *end ? end + 1 : end;
+    *end = '\0';
+    bool found = false;
+    for (size_t i = 0; i < current->children->len; i++) {
+      XMLNode *child = (XMLNode *)current->children->data[i];
+      if (!child->tag) continue;
+      if ((exact && strcmp(child->tag, segment) == 0) || (!exact && strstr(child->tag, segment) != NULL)) {
+        current = child;
+        found = true;
+        break;
+      }
+    }
+    if (!found) {
+      XML_FREE(node->allocator, tokenized_path);
+      return NULL;
+    }
+    segment = next;
+  }
+  XML_FREE(node->allocator, tokenized_path);
+  return current;
+}
+
+XML_H_API const char *xml_node_attr(XMLNode *node, const char *attr_key) {
+  if (!node || !attr_key) return NULL;
+  for (size_t i = 0; i < node->attrs->len; i++) {
+    XMLAttr *attr = (XMLAttr *)node->attrs->data[i];
+    if (attr->key && strcmp(attr->key, attr_key) == 0) return attr->value;
+  }
+  return NULL;
+}
+
+// Skip <!-- ... -->, <? ... ?>, <!DOCTYPE ... >
+// Returns true if skipped.
+static bool xml__skip_tags(const char *xml, size_t *idx) {
+  if (xml[*idx] == '!' || xml[*idx] == '?') {
+    size_t open_braket_count = 0;
+    while (xml[*idx] != '>' || (xml[*idx] == '>' && open_braket_count > 0)) {
+      if (xml[*idx] == '\0') return false;
+      if (xml[*idx] == '<') open_braket_count++;
+      if (xml[*idx] == '>') open_braket_count--;
+      (*idx)++;
+    }
+    (*idx)++; // Skip '>'
+    return true;
+  }
+  return false;
+}
+
+// Parse end tag </tag>.
+static void xml__parse_end_tag(const char *xml, size_t *idx, XMLNode **curr_node) {
+  (*idx)++; // Skip '/'
+  xml__skip_whitespace(xml, idx);
+  while (xml[*idx] != '>' && xml[*idx] != '\0') (*idx)++;
+  if (xml[*idx] == '>') (*idx)++; // Skip '>'
+  *curr_node = (*curr_node)->parent;
+}
+
+// Parse tag name <name ... >
+static void xml__parse_tag_name(const char *xml, size_t *idx, XMLNode **curr_node) {
+  size_t tag_start = *idx;
+  while (!(isspace(xml[*idx]) || xml[*idx] == '>' || xml[*idx] == '/') && xml[*idx] != '\0') (*idx)++;
+  (*curr_node)->tag = xml__strndup((*curr_node)->allocator, xml + tag_start, *idx - tag_start);
+  xml__tag_filter_add(*curr_node, xml__tag_bits((*curr_node)->tag));
+}
+
+// Parse tag attributes <tag attr="value" ... >
+static void xml__parse_tag_attributes(const char *xml, size_t *idx, XMLNode **curr_node) {
+  xml__skip_whitespace(xml, idx);
+  while (xml[*idx] != '\0' && !(xml[*idx] == '>' || xml[*idx] == '/')) {
+    size_t attr_start = *idx;
+    while (xml[*idx] != '\0' && xml[*idx] != '=' && !isspace(xml[*idx])) (*idx)++;
+    if (*idx == attr_start) {
+      while (xml[*idx] != '\0' && xml[*idx] != '>' && xml[*idx] != '/') { (*idx)++; }
+      break;
+    }
+    size_t attr_len = *idx - attr_start;
+    xml__skip_whitespace(xml, idx);
+    if (xml[*idx] != '=') break;
     (*idx)++;
     xml__skip_whitespace(xml, idx);
     char quote = xml[*idx];
@@ -429,165 +2277,2506 @@ static void xml__parse_tag_attributes(const char *xml, size_t *idx, XMLNode **cu
         if (*idx == 0 || xml[*idx - 1] != '\\') break;
       (*idx)++;
     }
-    if (xml[*idx] == '\0') break;
-    size_t value_len = *idx - value_start;
-    char attr_value[value_len + 1];
-    strncpy(attr_value, xml + value_start, value_len);
-    attr_value[value_len] = '\0';
-    (*idx)++; // Skip closing quote
-    xml_node_add_attr(*curr_node, attr_key, attr_value);
-    xml__skip_whitespace(xml, idx);
+    if (xml[*idx] == '\0') break;
+    size_t value_len = *idx - value_start;
+    (*idx)++; // Skip closing quote
+    const XMLAllocator *allocator = (*curr_node)->allocator;
+    xml__node_add_attr(*curr_node, xml__strndup(allocator, xml + attr_start, attr_len), XML_STR_TAKE,
+                       xml__strndup(allocator, xml + value_start, value_len), XML_STR_TAKE);
+    xml__skip_whitespace(xml, idx);
+  }
+}
+
+static void xml__parse_tag_inner_text(const char *xml, size_t *idx, XMLNode **curr_node) {
+  size_t text_start = *idx;
+  while (xml[*idx] != '<' && xml[*idx] != '\0') (*idx)++;
+  if (*idx > text_start) (*curr_node)->text = xml__decode_entities((*curr_node)->allocator, xml + text_start, *idx - text_start);
+}
+
+// Parse start tag.
+// Returns false if the tag is self-closing like: <tag />
+// Call continue if returns false.
+static bool xml__parse_tag(const char *xml, size_t *idx, XMLNode **curr_node) {
+  xml__skip_whitespace(xml, idx);
+  if (xml__skip_tags(xml, idx)) return false;
+  // End tag </tag>
+  if (xml[*idx] == '/') {
+    xml__parse_end_tag(xml, idx, curr_node);
+    return false;
+  }
+  // Create new node with current curr_node as parent
+  *curr_node = xml_node_new(*curr_node, NULL, NULL);
+  // Start tag <tag...>
+  xml__parse_tag_name(xml, idx, curr_node);
+  // Parse attributes
+  if (xml[*idx] != '\0' && isspace(xml[*idx])) xml__parse_tag_attributes(xml, idx, curr_node);
+  // Self-closing tag <tag ... />
+  if (xml[*idx] == '/') {
+    (*idx)++; // Skip '/'
+    while (xml[*idx] != '>' && xml[*idx] != '\0') (*idx)++;
+    if (xml[*idx] == '\0') return false;
+    (*idx)++; // Consume '>'
+    *curr_node = (*curr_node)->parent;
+    return false;
+  }
+  // Start tag <tag ... >
+  else if (xml[*idx] == '>') {
+    (*idx)++; // Consume '>'
+    xml__skip_whitespace(xml, idx);
+    xml__parse_tag_inner_text(xml, idx, curr_node);
+    // If the next character is '<', parse the next tag
+    if (xml[*idx] == '<') {
+      (*idx)++; // Consume '<'
+      return xml__parse_tag(xml, idx, curr_node);
+    }
+    return true;
+  }
+  xml__skip_whitespace(xml, idx);
+  return true;
+}
+
+XML_H_API XMLNode *xml_parse_string(const char *xml) { return xml_parse_string_with_allocator(xml, NULL); }
+
+XML_H_API XMLNode *xml_parse_string_with_allocator(const char *xml, const XMLAllocator *allocator) {
+  XMLNode *root = xml_node_new_with_allocator(NULL, NULL, NULL, allocator);
+  XMLNode *curr_node = root;
+  size_t idx = 0;
+  while (xml[idx] != '\0') {
+    xml__skip_whitespace(xml, &idx);
+    // Parse tag
+    if (xml[idx] == '<') {
+      idx++;
+      xml__skip_whitespace(xml, &idx);
+      if (xml__skip_tags(xml, &idx)) continue;
+      if (!xml__parse_tag(xml, &idx, &curr_node)) continue;
+    }
+    // Truncated tag stops at the end of string
+    if (xml[idx] != '\0') idx++;
+  }
+  xml_node_update_order(root);
+  return root;
+}
+
+XML_H_API XMLNode *xml_parse_string_n(const char *data, size_t len) {
+  if (!data) return NULL;
+  char *xml = xml__strndup(NULL, data, len);
+  if (!xml) return NULL;
+  XMLNode *root = xml_parse_string(xml);
+  XML_FREE(NULL, xml);
+  return root;
+}
+
+XML_H_API XMLNode *xml_parse_file(const char *path) { return xml_parse_file_with_allocator(path, NULL); }
+
+XML_H_API XMLNode *xml_parse_file_with_allocator(const char *path, const XMLAllocator *allocator) {
+  FILE *file = fopen(path, "rb");
+  if (!file) return NULL;
+  fseek(file, 0, SEEK_END);
+  size_t file_size = ftell(file);
+  fseek(file, 0, SEEK_SET);
+  char *buffer = (char *)xml__calloc(allocator, 1, file_size + 1);
+  if (!buffer) {
+    fclose(file);
+    return NULL;
+  }
+  size_t bytes_read = fread(buffer, 1, file_size, file);
+  if (bytes_read != file_size) {
+    XML_FREE(allocator, buffer);
+    fclose(file);
+    return NULL;
+  }
+  buffer[file_size] = '\0';
+  fclose(file);
+  XMLNode *node = xml_parse_string_with_allocator(buffer, allocator);
+  XML_FREE(allocator, buffer);
+  return node;
+}
+
+XML_H_API void xml_node_serialize(XMLNode *node, XMLString *str) {
+  if (!node || !str) return;
+
+  if (node->tag) {
+    xml_string_append(str, "<");
+    xml_string_append(str, node->tag);
+    // Attributes
+    for (size_t i = 0; i < node->attrs->len; ++i) {
+      XMLAttr *attr = (XMLAttr *)node->attrs->data[i];
+      xml_string_append(str, " ");
+      xml_string_append(str, attr->key);
+      xml_string_append(str, "=\"");
+      xml_string_append(str, attr->value);
+      xml_string_append(str, "\"");
+    }
+    // Self-closing case
+    if (node->children->len == 0 && !node->text) {
+      xml_string_append(str, "/>");
+      return;
+    }
+    xml_string_append(str, ">");
+  }
+  // Text
+  if (node->text) xml_string_append(str, node->text);
+  // Children
+  for (size_t i = 0; i < node->children->len; ++i) {
+    XMLNode *child = (XMLNode *)node->children->data[i];
+    xml_node_serialize(child, str);
+  }
+  // Closing tag
+  if (node->tag) {
+    xml_string_append(str, "</");
+    xml_string_append(str, node->tag);
+    xml_string_append(str, ">");
+  }
+}
+
+// ---------- XMLSortedIndex ---------- //
+
+typedef struct {
+  double key;
+  const char *string;
+  size_t pos; // Position among indexed children, keeps sorting stable
+  XMLNode *child;
+} XMLSortedItem;
+
+static int xml__sorted_compare_numeric(const void *a, const void *b) {
+  const XMLSortedItem *x = (const XMLSortedItem *)a, *y = (const XMLSortedItem *)b;
+  if (x->key != y->key) return x->key < y->key ? -1 : 1;
+  return x->pos < y->pos ? -1 : x->pos > y->pos;
+}
+
+static int xml__sorted_compare_lexical(const void *a, const void *b) {
+  const XMLSortedItem *x = (const XMLSortedItem *)a, *y = (const XMLSortedItem *)b;
+  int cmp = strcmp(x->string, y->string);
+  if (cmp) return cmp;
+  return x->pos < y->pos ? -1 : x->pos > y->pos;
+}
+
+// Parse whole string as a number. Returns false if it's not a number.
+static bool xml__parse_number(const char *str, double *value) {
+  char *end;
+  *value = strtod(str, &end);
+  if (end == str || *value != *value) return false;
+  while (isspace((unsigned char)*end)) end++;
+  return *end == '\0';
+}
+
+XML_H_API XMLSortedIndex *xml_node_build_sorted_index(XMLNode *node, const char *child_tag, const char *attr,
+                                                      XMLSortMode mode) {
+  if (!node || !attr) return NULL;
+  const XMLAllocator *allocator = node->allocator;
+  XMLSortedIndex *index = (XMLSortedIndex *)xml__calloc(allocator, 1, sizeof(XMLSortedIndex));
+  if (!index) return NULL;
+  index->mode = mode;
+  index->allocator = allocator;
+  size_t children_len = node->children->len;
+  XMLSortedItem *items = (XMLSortedItem *)xml__calloc(allocator, children_len ? children_len : 1,
+                                                      sizeof(XMLSortedItem));
+  if (!items) {
+    XML_FREE(allocator, index);
+    return NULL;
+  }
+  // Collect children with the attribute
+  size_t len = 0;
+  for (size_t i = 0; i < children_len; i++) {
+    XMLNode *child = (XMLNode *)node->children->data[i];
+    if (child_tag && !(child->tag && strcmp(child->tag, child_tag) == 0)) continue;
+    const char *value = xml_node_attr(child, attr);
+    if (!value) continue;
+    XMLSortedItem *item = &items[len];
+    if (mode == XML_NUMERIC && !xml__parse_number(value, &item->key)) continue;
+    item->string = value;
+    item->pos = len;
+    item->child = child;
+    len++;
+  }
+  qsort(items, len, sizeof(XMLSortedItem),
+        mode == XML_NUMERIC ? xml__sorted_compare_numeric : xml__sorted_compare_lexical);
+  // Keys are stored apart from children, so binary search touches only them
+  index->children = (XMLNode **)xml__calloc(allocator, len ? len : 1, sizeof(XMLNode *));
+  if (mode == XML_NUMERIC) index->keys = (double *)xml__calloc(allocator, len ? len : 1, sizeof(double));
+  else index->strings = (const char **)xml__calloc(allocator, len ? len : 1, sizeof(char *));
+  if (!index->children || (!index->keys && !index->strings)) {
+    XML_FREE(allocator, items);
+    xml_sorted_index_free(index);
+    return NULL;
+  }
+  for (size_t i = 0; i < len; i++) {
+    index->children[i] = items[i].child;
+    if (mode == XML_NUMERIC) index->keys[i] = items[i].key;
+    else index->strings[i] = items[i].string;
+  }
+  index->len = len;
+  XML_FREE(allocator, items);
+  return index;
+}
+
+XML_H_API XMLNode **xml_sorted_index_range(XMLSortedIndex *index, double min, double max, size_t *len) {
+  if (len) *len = 0;
+  if (!index || !len || !index->keys || !(min <= max)) return NULL;
+  // First key >= min
+  size_t lo = 0, hi = index->len;
+  while (lo < hi) {
+    size_t mid = lo + (hi - lo) / 2;
+    if (index->keys[mid] < min) lo = mid + 1;
+    else hi = mid;
+  }
+  size_t start = lo;
+  // First key > max
+  hi = index->len;
+  while (lo < hi) {
+    size_t mid = lo + (hi - lo) / 2;
+    if (index->keys[mid] <= max) lo = mid + 1;
+    else hi = mid;
+  }
+  *len = lo - start;
+  return *len ? index->children + start : NULL;
+}
+
+XML_H_API XMLNode **xml_sorted_index_range_str(XMLSortedIndex *index, const char *min, const char *max,
+                                               size_t *len) {
+  if (len) *len = 0;
+  if (!index || !len || !index->strings) return NULL;
+  // First string >= min
+  size_t lo = 0, hi = index->len;
+  while (min && lo < hi) {
+    size_t mid = lo + (hi - lo) / 2;
+    if (strcmp(index->strings[mid], min) < 0) lo = mid + 1;
+    else hi = mid;
+  }
+  size_t start = lo;
+  // First string > max
+  hi = index->len;
+  if (!max) lo = hi;
+  while (lo < hi) {
+    size_t mid = lo + (hi - lo) / 2;
+    if (strcmp(index->strings[mid], max) <= 0) lo = mid + 1;
+    else hi = mid;
+  }
+  *len = lo > start ? lo - start : 0;
+  return *len ? index->children + start : NULL;
+}
+
+XML_H_API void xml_sorted_index_free(XMLSortedIndex *index) {
+  if (!index) return;
+  XML_FREE(index->allocator, index->keys);
+  XML_FREE(index->allocator, index->strings);
+  XML_FREE(index->allocator, index->children);
+  XML_FREE(index->allocator, index);
+}
+
+// ---------- Text search ---------- //
+
+static inline char xml__ascii_lower(char c) { return c >= 'A' && c <= 'Z' ? (char)(c - 'A' + 'a') : c; }
+
+static inline bool xml__equal_n(const char *a, const char *b, size_t len, bool ignore_case) {
+  if (!ignore_case) return memcmp(a, b, len) == 0;
+  for (size_t i = 0; i < len; i++)
+    if (xml__ascii_lower(a[i]) != xml__ascii_lower(b[i])) return false;
+  return true;
+}
+
+// Candidate positions of the word where first and last bytes of the needle match (with case variants).
+// Can have false positives, but never misses.
+static inline uint64_t xml__find_candidates(uint64_t first_word, uint64_t last_word, char first, char last,
+                                            bool ignore_case) {
+  uint64_t firsts = XML__HAS_BYTE(first_word, (unsigned char)first);
+  uint64_t lasts = XML__HAS_BYTE(last_word, (unsigned char)last);
+  if (ignore_case) {
+    firsts |= XML__HAS_BYTE(first_word, (unsigned char)(first - 'a' + 'A'));
+    lasts |= XML__HAS_BYTE(last_word, (unsigned char)(last - 'a' + 'A'));
+  }
+  return firsts & lasts;
+}
+
+// Find `needle` of `needle_len` bytes in `len` bytes of `str`.
+// Checks first and last bytes of the needle at 8 positions at a time and compares the whole needle
+// only where both match, so most of the text is skipped without byte by byte comparisons.
+// Returns pointer to the first match or NULL.
+static const char *xml__find_substring(const char *str, size_t len, const char *needle, size_t needle_len,
+                                       bool ignore_case) {
+  if (needle_len == 0) return str;
+  if (needle_len > len) return NULL;
+  char first = ignore_case ? xml__ascii_lower(needle[0]) : needle[0];
+  char last = ignore_case ? xml__ascii_lower(needle[needle_len - 1]) : needle[needle_len - 1];
+  // Case variants are checked only for letters
+  bool fold = ignore_case && ((first >= 'a' && first <= 'z') || (last >= 'a' && last <= 'z'));
+  size_t end = len - needle_len + 1; // Number of positions to check
+  size_t i = 0;
+  for (; i + 8 <= end; i += 8) {
+    uint64_t first_word, last_word;
+    memcpy(&first_word, str + i, 8);
+    memcpy(&last_word, str + i + needle_len - 1, 8);
+    if (!xml__find_candidates(first_word, last_word, first, last, fold)) continue;
+    for (size_t k = i; k < i + 8; k++)
+      if (xml__equal_n(str + k, needle, needle_len, ignore_case)) return str + k;
+  }
+  for (; i < end; i++)
+    if (xml__equal_n(str + i, needle, needle_len, ignore_case)) return str + i;
+  return NULL;
+}
+
+// Move to the next node of the search in pre-order. Returns NULL at the end.
+static XMLNode *xml__text_iter_next(XMLTextIter *iter) {
+  XMLNode *node = iter->node;
+  if (node->children->len) {
+    if (iter->depth == iter->size) {
+      size_t size = iter->size ? iter->size * 2 : 16;
+      size_t *path = (size_t *)XML_REALLOC_FUNC(iter->path, size * sizeof(size_t));
+      if (!path) return NULL;
+      iter->path = path;
+      iter->size = size;
+    }
+    iter->path[iter->depth++] = 0;
+    return iter->node = (XMLNode *)node->children->data[0];
+  }
+  while (iter->depth > 0) {
+    XMLNode *parent = node->parent;
+    size_t idx = ++iter->path[iter->depth - 1];
+    if (idx < parent->children->len) return iter->node = (XMLNode *)parent->children->data[idx];
+    iter->depth--;
+    node = parent;
+  }
+  return iter->node = NULL;
+}
+
+// Set up sweeping of the strings area if the tree is a part of not edited compacted block.
+static void xml__text_iter_pool(XMLTextIter *iter, XMLNode *root) {
+  XMLNode *owner = root;
+  while (owner && (XML__ATOMIC_LOAD_RELAXED(&owner->flags) & XML__NODE_BORROWED)) owner = owner->parent;
+  if (!owner || !xml__is_pristine_block(owner)) return;
+  // Strings of the subtree are packed in pre-order, the last one belongs to the last node
+  XMLNode *last = root;
+  while (last->children->len) last = (XMLNode *)last->children->data[last->children->len - 1];
+  const char *str = last->tag;
+  if (last->text) str = last->text;
+  if (last->attrs->len) str = ((XMLAttr *)last->attrs->data[last->attrs->len - 1])->value;
+  if (str) iter->pool_end = str + strlen(str) + 1;
+}
+
+XML_H_API XMLNode *xml_node_find_text(XMLNode *root, const char *needle, unsigned flags, XMLTextIter *iter) {
+  if (!root || !needle || !iter || iter->done) return NULL;
+  bool ignore_case = flags & XML_FIND_TEXT_IGNORE_CASE;
+  size_t needle_len = strlen(needle);
+  XMLNode *node;
+  if (!iter->node && !iter->started) {
+    iter->started = true;
+    xml__text_iter_pool(iter, root);
+    node = iter->node = root;
+  } else node = iter->node ? xml__text_iter_next(iter) : NULL;
+  for (; node; node = xml__text_iter_next(iter)) {
+    if (!node->text) continue;
+    if (iter->pool_end) {
+      // Search the rest of the strings area once and skip nodes before the match
+      if (!iter->hit || iter->hit < node->text) {
+        iter->hit = xml__find_substring(node->text, (size_t)(iter->pool_end - node->text), needle, needle_len,
+                                        ignore_case);
+        if (!iter->hit) break;
+      }
+      // Match is in the node's text if there is no string end before it
+      if (!memchr(node->text, '\0', (size_t)(iter->hit - node->text))) return node;
+    } else if (xml__find_substring(node->text, strlen(node->text), needle, needle_len, ignore_case))
+      return node;
+  }
+  // Free the path, but stay at the end
+  xml_text_iter_free(iter);
+  iter->started = true;
+  iter->done = true;
+  return NULL;
+}
+
+XML_H_API void xml_text_iter_free(XMLTextIter *iter) {
+  if (!iter) return;
+  XML_FREE(NULL, iter->path);
+  memset(iter, 0, sizeof(XMLTextIter));
+}
+
+// ---------- Tokenizer ---------- //
+
+// Tokens of the streaming tokenizer. Comments, processing instructions and <!DOCTYPE ... > are skipped.
+typedef enum {
+  XML__TOKEN_START, // Start tag <name ...> or <name ... />
+  XML__TOKEN_END,   // End tag </name>
+  XML__TOKEN_TEXT,  // Text between tags or CDATA section
+} XMLTokenType;
+
+typedef struct {
+  XMLTokenType type;
+  const char *name;  // Tag name of START and END tokens. Not null-terminated.
+  size_t name_len;   // Length of tag name
+  const char *attrs; // Raw attributes of START token. Not null-terminated.
+  size_t attrs_len;  // Length of raw attributes
+  const char *text;  // Raw text of TEXT token with not decoded entities. Not null-terminated.
+  size_t text_len;   // Length of the text
+  bool cdata;        // TEXT token is a CDATA section, it's text must not be decoded
+  bool self_closing; // START token is self-closing tag
+  size_t start;      // Offset of the first byte of the token
+  size_t end;        // Offset after the last byte of the token
+} XMLToken;
+
+// Tokenizer over the buffer. Doesn't need null-terminated input and doesn't allocate.
+typedef struct {
+  const char *data;
+  size_t len;
+  size_t pos;
+} XMLTokenizer;
+
+static inline void xml__tokenizer_init(XMLTokenizer *tokenizer, const char *data, size_t len) {
+  tokenizer->data = data;
+  tokenizer->len = len;
+  tokenizer->pos = 0;
+}
+
+// Check if `data` at `pos` starts with `prefix`.
+static inline bool xml__token_starts_with(XMLTokenizer *tokenizer, size_t pos, const char *prefix, size_t len) {
+  return tokenizer->len - pos >= len && memcmp(tokenizer->data + pos, prefix, len) == 0;
+}
+
+// Find `needle` starting from `pos`. Returns offset after it or `len` if not found.
+static inline size_t xml__token_skip_past(XMLTokenizer *tokenizer, size_t pos, const char *needle, size_t len) {
+  for (; pos + len <= tokenizer->len; pos++)
+    if (tokenizer->data[pos] == needle[0] && memcmp(tokenizer->data + pos, needle, len) == 0) return pos + len;
+  return tokenizer->len;
+}
+
+// XML whitespace. Cheaper than `isspace()` that goes through locale tables.
+static inline bool xml__token_is_space(char c) { return c == ' ' || c == '\n' || c == '\t' || c == '\r'; }
+
+static inline bool xml__token_is_name_end(char c) { return xml__token_is_space(c) || c == '>' || c == '/'; }
+
+// Read the next token. Returns false at the end of data or if the last tag is truncated.
+static bool xml__next_token(XMLTokenizer *tokenizer, XMLToken *token) {
+  const char *data = tokenizer->data;
+  size_t len = tokenizer->len;
+  while (tokenizer->pos < len) {
+    size_t pos = tokenizer->pos;
+    memset(token, 0, sizeof(XMLToken));
+    token->start = pos;
+    // Text
+    if (data[pos] != '<') {
+      const char *lt = (const char *)memchr(data + pos, '<', len - pos);
+      size_t end = lt ? (size_t)(lt - data) : len;
+      tokenizer->pos = end;
+      size_t i = pos;
+      while (i < end && xml__token_is_space(data[i])) i++;
+      if (i == end) continue; // Whitespace only
+      token->type = XML__TOKEN_TEXT;
+      token->text = data + pos;
+      token->text_len = end - pos;
+      token->end = end;
+      return true;
+    }
+    pos++; // Skip '<'
+    if (xml__token_starts_with(tokenizer, pos, "!--", 3)) {
+      tokenizer->pos = xml__token_skip_past(tokenizer, pos + 3, "-->", 3);
+      continue;
+    }
+    if (xml__token_starts_with(tokenizer, pos, "![CDATA[", 8)) {
+      size_t end = xml__token_skip_past(tokenizer, pos + 8, "]]>", 3);
+      if (end == len && !xml__token_starts_with(tokenizer, len - 3, "]]>", 3)) return false;
+      tokenizer->pos = end;
+      token->type = XML__TOKEN_TEXT;
+      token->text = data + pos + 8;
+      token->text_len = end - 3 - (pos + 8);
+      token->cdata = true;
+      token->end = end;
+      return true;
+    }
+    if (pos < len && (data[pos] == '!' || data[pos] == '?')) {
+      // Same as xml__skip_tags(): nested brackets of <!DOCTYPE ... [ <!ENTITY ... > ]> are balanced
+      size_t depth = 0;
+      for (; pos < len && (data[pos] != '>' || depth > 0); pos++) {
+        if (data[pos] == '<') depth++;
+        if (data[pos] == '>') depth--;
+      }
+      tokenizer->pos = pos < len ? pos + 1 : len;
+      continue;
+    }
+    // End tag
+    if (pos < len && data[pos] == '/') {
+      pos++;
+      while (pos < len && xml__token_is_space(data[pos])) pos++;
+      token->type = XML__TOKEN_END;
+      token->name = data + pos;
+      while (pos < len && !xml__token_is_name_end(data[pos])) pos++;
+      token->name_len = (size_t)(data + pos - token->name);
+      const char *gt = (const char *)memchr(data + pos, '>', len - pos);
+      if (!gt) return false;
+      token->end = tokenizer->pos = (size_t)(gt - data) + 1;
+      return true;
+    }
+    // Start tag
+    token->type = XML__TOKEN_START;
+    token->name = data + pos;
+    while (pos < len && !xml__token_is_name_end(data[pos])) pos++;
+    token->name_len = (size_t)(data + pos - token->name);
+    token->attrs = data + pos;
+    // Find '>' outside of quoted values
+    for (;;) {
+      const char *gt = (const char *)memchr(data + pos, '>', len - pos);
+      if (!gt) return false;
+      size_t quote = pos;
+      while (quote < (size_t)(gt - data) && data[quote] != '"' && data[quote] != '\'') quote++;
+      if (quote == (size_t)(gt - data)) {
+        pos = quote;
+        break;
+      }
+      const char *closing = (const char *)memchr(data + quote + 1, data[quote], len - quote - 1);
+      if (!closing) return false;
+      pos = (size_t)(closing - data) + 1;
+    }
+    token->attrs_len = (size_t)(data + pos - token->attrs);
+    if (token->attrs_len && token->attrs[token->attrs_len - 1] == '/') {
+      token->self_closing = true;
+      token->attrs_len--;
+    }
+    token->end = tokenizer->pos = pos + 1;
+    return true;
+  }
+  return false;
+}
+
+// Check if token's tag name equals `name` of `len` bytes.
+static inline bool xml__token_name_is(const XMLToken *token, const char *name, size_t len) {
+  return token->name_len == len && memcmp(token->name, name, len) == 0;
+}
+
+// Find attribute of START token with `key` of `key_len` bytes.
+// Returns false if the token doesn't have it.
+static bool xml__token_attr(const XMLToken *token, const char *key, size_t key_len, const char **value,
+                            size_t *value_len) {
+  const char *c = token->attrs, *end = token->attrs + token->attrs_len;
+  while (c < end) {
+    while (c < end && xml__token_is_space(*c)) c++;
+    const char *name = c;
+    while (c < end && *c != '=' && !xml__token_is_space(*c)) c++;
+    size_t name_len = (size_t)(c - name);
+    while (c < end && xml__token_is_space(*c)) c++;
+    if (c >= end || *c != '=' || name_len == 0) return false;
+    c++;
+    while (c < end && xml__token_is_space(*c)) c++;
+    if (c >= end || (*c != '"' && *c != '\'')) return false;
+    char quote = *c++;
+    const char *start = c;
+    while (c < end && *c != quote) c++;
+    if (c >= end) return false;
+    if (name_len == key_len && memcmp(name, key, key_len) == 0) {
+      *value = start;
+      *value_len = (size_t)(c - start);
+      return true;
+    }
+    c++; // Skip closing quote
+  }
+  return false;
+}
+
+// ---------- Paths ---------- //
+
+// Path segment pointing into the path string.
+typedef struct {
+  const char *name;
+  size_t len;
+} XMLPathSegment;
+
+// Split path into segments like `strtok()` does. Returns NULL for error.
+static XMLPathSegment *xml__split_path(const char *path, size_t *segments_len) {
+  size_t count = 1;
+  for (const char *c = path; *c; c++) count += *c == '/';
+  XMLPathSegment *segments = (XMLPathSegment *)XML_CALLOC_FUNC(count, sizeof(XMLPathSegment));
+  if (!segments) return NULL;
+  *segments_len = 0;
+  while (*path) {
+    while (*path == '/') path++;
+    if (!*path) break;
+    const char *start = path;
+    while (*path && *path != '/') path++;
+    segments[*segments_len].name = start;
+    segments[*segments_len].len = (size_t)(path - start);
+    (*segments_len)++;
+  }
+  return segments;
+}
+
+// ---------- XMLQuerySet ---------- //
+
+#define XML__QUERY_NONE SIZE_MAX
+#define XML__QUERY_ROOT 0     // State of the node queries are relative to
+#define XML__QUERY_ANYWHERE 1 // State with self loop, for single tag queries matching at any depth
+
+// State of the automaton. All states except the root and the anywhere state are reached by tag name.
+typedef struct {
+  char *name;         // Tag name leading to the state
+  size_t name_len;    // Length of the tag name
+  size_t first_query; // First query accepted in the state or XML__QUERY_NONE
+  size_t last_query;  // Last query accepted in the state
+} XMLQueryState;
+
+// Transition from state `from` by tag name with `hash` to state `to`.
+typedef struct {
+  uint64_t hash;
+  size_t from;
+  size_t to; // XML__QUERY_NONE for empty slot
+} XMLQueryEdge;
+
+struct XMLQuerySet {
+  XMLQueryState *states;
+  size_t states_len;
+  size_t states_size;
+  XMLQueryEdge *edges; // Open addressing hash table of transitions. Number of slots is a power of two.
+  size_t edges_len;
+  size_t edges_size;
+  size_t *next_query; // Next query accepted in the same state for every query
+  size_t queries_len;
+  size_t queries_size;
+  bool has_anywhere; // Set has single tag queries
+};
+
+// Run of the automaton: sets of active states for every open element.
+typedef struct {
+  size_t *active; // Active states of all frames
+  size_t active_len;
+  size_t active_size;
+  size_t *frames; // Start of every frame in `active`
+  size_t frames_len;
+  size_t frames_size;
+} XMLQueryRun;
+
+// Make room for one more item in growable array. Returns false for error.
+static bool xml__query_grow(void **data, size_t len, size_t *size, size_t item_size) {
+  if (len < *size) return true;
+  size_t new_size = *size ? *size * 2 : 16;
+  void *grown = XML_REALLOC_FUNC(*data, new_size * item_size);
+  if (!grown) return false;
+  *data = grown;
+  *size = new_size;
+  return true;
+}
+
+static inline uint64_t xml__query_edge_hash(size_t from, uint64_t name_hash) {
+  return name_hash ^ ((uint64_t)from * 0x9E3779B97F4A7C15ull);
+}
+
+// Find slot of the transition or empty slot where it should be inserted.
+static inline XMLQueryEdge *xml__query_edge_slot(XMLQuerySet *set, size_t from, const char *name, size_t len,
+                                                 uint64_t hash) {
+  size_t mask = set->edges_size - 1;
+  for (size_t i = hash & mask;; i = (i + 1) & mask) {
+    XMLQueryEdge *edge = &set->edges[i];
+    if (edge->to == XML__QUERY_NONE) return edge;
+    XMLQueryState *state = &set->states[edge->to];
+    if (edge->hash == hash && edge->from == from && state->name_len == len && memcmp(state->name, name, len) == 0)
+      return edge;
+  }
+}
+
+// Get state reached from `from` by tag name. Returns XML__QUERY_NONE if there is no transition.
+static inline size_t xml__query_step(XMLQuerySet *set, size_t from, const char *name, size_t len,
+                                     uint64_t name_hash) {
+  if (!set->edges_len) return XML__QUERY_NONE;
+  return xml__query_edge_slot(set, from, name, len, xml__query_edge_hash(from, name_hash))->to;
+}
+
+// Resize transitions table to `size` slots. Returns false for error.
+static bool xml__query_edges_resize(XMLQuerySet *set, size_t size) {
+  XMLQueryEdge *edges = (XMLQueryEdge *)XML_CALLOC_FUNC(size, sizeof(XMLQueryEdge));
+  if (!edges) return false;
+  for (size_t i = 0; i < size; i++) edges[i].to = XML__QUERY_NONE;
+  XMLQueryEdge *old = set->edges;
+  size_t old_size = set->edges_size;
+  set->edges = edges;
+  set->edges_size = size;
+  for (size_t i = 0; i < old_size; i++) {
+    if (old[i].to == XML__QUERY_NONE) continue;
+    XMLQueryState *state = &set->states[old[i].to];
+    *xml__query_edge_slot(set, old[i].from, state->name, state->name_len, old[i].hash) = old[i];
+  }
+  XML_FREE(NULL, old);
+  return true;
+}
+
+// Add state with no accepted queries. Returns XML__QUERY_NONE for error.
+static size_t xml__query_add_state(XMLQuerySet *set, const char *name, size_t len) {
+  if (!xml__query_grow((void **)&set->states, set->states_len, &set->states_size, sizeof(XMLQueryState)))
+    return XML__QUERY_NONE;
+  XMLQueryState *state = &set->states[set->states_len];
+  state->name = name ? xml__strndup(NULL, name, len) : NULL;
+  if (name && !state->name) return XML__QUERY_NONE;
+  state->name_len = len;
+  state->first_query = state->last_query = XML__QUERY_NONE;
+  return set->states_len++;
+}
+
+XML_H_API XMLQuerySet *xml_query_set_new() {
+  XMLQuerySet *set = (XMLQuerySet *)XML_CALLOC_FUNC(1, sizeof(XMLQuerySet));
+  if (!set) return NULL;
+  if (xml__query_add_state(set, NULL, 0) == XML__QUERY_NONE || xml__query_add_state(set, NULL, 0) == XML__QUERY_NONE) {
+    xml_query_set_free(set);
+    return NULL;
+  }
+  return set;
+}
+
+XML_H_API size_t xml_query_set_add(XMLQuerySet *set, const char *path) {
+  if (!set || !path) return XML__QUERY_NONE;
+  size_t segments_len;
+  XMLPathSegment *segments = xml__split_path(path, &segments_len);
+  if (!segments) return XML__QUERY_NONE;
+  if (segments_len == 0 ||
+      !xml__query_grow((void **)&set->next_query, set->queries_len, &set->queries_size, sizeof(size_t))) {
+    XML_FREE(NULL, segments);
+    return XML__QUERY_NONE;
+  }
+  // Single tag matches at any depth like in xml_node_find_tag()
+  size_t state = strchr(path, '/') ? XML__QUERY_ROOT : XML__QUERY_ANYWHERE;
+  if (state == XML__QUERY_ANYWHERE) set->has_anywhere = true;
+  for (size_t i = 0; i < segments_len && state != XML__QUERY_NONE; i++) {
+    const char *name = segments[i].name;
+    size_t len = segments[i].len;
+    uint64_t name_hash = xml__hash_n(name, len);
+    size_t next = xml__query_step(set, state, name, len, name_hash);
+    if (next != XML__QUERY_NONE) {
+      state = next;
+      continue;
+    }
+    // Keep load factor under 3/4
+    if ((set->edges_len + 1) * 4 > set->edges_size * 3 &&
+        !xml__query_edges_resize(set, set->edges_size ? set->edges_size * 2 : 16)) {
+      state = XML__QUERY_NONE;
+      break;
+    }
+    next = xml__query_add_state(set, name, len);
+    if (next == XML__QUERY_NONE) {
+      state = XML__QUERY_NONE;
+      break;
+    }
+    uint64_t hash = xml__query_edge_hash(state, name_hash);
+    XMLQueryEdge *edge = xml__query_edge_slot(set, state, name, len, hash);
+    edge->hash = hash;
+    edge->from = state;
+    edge->to = next;
+    set->edges_len++;
+    state = next;
+  }
+  XML_FREE(NULL, segments);
+  if (state == XML__QUERY_NONE) return XML__QUERY_NONE;
+  // Accept the query in the last state
+  size_t id = set->queries_len;
+  set->next_query[id] = XML__QUERY_NONE;
+  XMLQueryState *accepting = &set->states[state];
+  if (accepting->first_query == XML__QUERY_NONE) accepting->first_query = id;
+  else set->next_query[accepting->last_query] = id;
+  accepting->last_query = id;
+  set->queries_len++;
+  return id;
+}
+
+XML_H_API void xml_query_set_free(XMLQuerySet *set) {
+  if (!set) return;
+  for (size_t i = 0; i < set->states_len; i++) XML_FREE(NULL, set->states[i].name);
+  XML_FREE(NULL, set->states);
+  XML_FREE(NULL, set->edges);
+  XML_FREE(NULL, set->next_query);
+  XML_FREE(NULL, set);
+}
+
+// Start the run with the frame of the node queries are relative to. Returns false for error.
+static bool xml__query_run_init(XMLQuerySet *set, XMLQueryRun *run) {
+  memset(run, 0, sizeof(XMLQueryRun));
+  if (!xml__query_grow((void **)&run->frames, 0, &run->frames_size, sizeof(size_t)) ||
+      !xml__query_grow((void **)&run->active, 0, &run->active_size, sizeof(size_t)))
+    return false;
+  run->frames[run->frames_len++] = 0;
+  run->active[run->active_len++] = XML__QUERY_ROOT;
+  // Without single tag queries subtrees that no path leads into are skipped
+  if (set->has_anywhere) run->active[run->active_len++] = XML__QUERY_ANYWHERE;
+  return true;
+}
+
+static void xml__query_run_free(XMLQueryRun *run) {
+  XML_FREE(NULL, run->active);
+  XML_FREE(NULL, run->frames);
+}
+
+// Add frame of states reached from the current frame by opening element with tag name.
+// Returns false for error.
+static bool xml__query_run_push(XMLQuerySet *set, XMLQueryRun *run, const char *name, size_t len) {
+  if (!xml__query_grow((void **)&run->frames, run->frames_len, &run->frames_size, sizeof(size_t))) return false;
+  size_t from = run->frames[run->frames_len - 1], to = run->active_len;
+  run->frames[run->frames_len++] = to;
+  uint64_t name_hash = xml__hash_n(name, len);
+  for (size_t i = from; i < to; i++) {
+    size_t state = run->active[i];
+    size_t next = xml__query_step(set, state, name, len, name_hash);
+    for (int k = 0; k < 2; k++) {
+      // Anywhere state stays active in all descendants
+      size_t add = k == 0 ? (state == XML__QUERY_ANYWHERE ? state : XML__QUERY_NONE) : next;
+      if (add == XML__QUERY_NONE) continue;
+      if (!xml__query_grow((void **)&run->active, run->active_len, &run->active_size, sizeof(size_t))) {
+        run->active_len = to;
+        run->frames_len--;
+        return false;
+      }
+      run->active[run->active_len++] = add;
+    }
+  }
+  return true;
+}
+
+static inline void xml__query_run_pop(XMLQueryRun *run) { run->active_len = run->frames[--run->frames_len]; }
+
+// Match descendants of the node. Returns false to stop.
+static bool xml__query_match_children(XMLQuerySet *set, XMLQueryRun *run, XMLNode *node,
+                                      XMLQueryNodeCallback callback, void *user_data, size_t *matches) {
+  for (size_t i = 0; i < node->children->len; i++) {
+    XMLNode *child = (XMLNode *)node->children->data[i];
+    if (!child->tag) continue;
+    if (!xml__query_run_push(set, run, child->tag, strlen(child->tag))) return false;
+    size_t frame = run->frames[run->frames_len - 1];
+    bool ok = true;
+    for (size_t a = frame; ok && a < run->active_len; a++)
+      for (size_t q = set->states[run->active[a]].first_query; ok && q != XML__QUERY_NONE; q = set->next_query[q]) {
+        (*matches)++;
+        ok = callback(q, child, user_data);
+      }
+    // Nothing can match inside if no states are active
+    if (ok && run->active_len > frame) ok = xml__query_match_children(set, run, child, callback, user_data, matches);
+    xml__query_run_pop(run);
+    if (!ok) return false;
+  }
+  return true;
+}
+
+XML_H_API size_t xml_query_set_match_node(XMLQuerySet *set, XMLNode *node, XMLQueryNodeCallback callback,
+                                          void *user_data) {
+  if (!set || !node || !callback) return 0;
+  XMLQueryRun run;
+  size_t matches = 0;
+  if (xml__query_run_init(set, &run)) xml__query_match_children(set, &run, node, callback, user_data, &matches);
+  xml__query_run_free(&run);
+  return matches;
+}
+
+// Element matched by query waiting for it's end tag.
+typedef struct {
+  size_t start; // Offset of the start tag
+  size_t depth; // Depth of the element
+  size_t query; // Query ID
+} XMLQueryOpen;
+
+XML_H_API size_t xml_query_set_match_stream(XMLQuerySet *set, const char *data, size_t len,
+                                            XMLQueryStreamCallback callback, void *user_data) {
+  if (!set || !data || !callback) return 0;
+  size_t matches = 0;
+  XMLQueryRun run;
+  XMLQueryOpen *open = NULL;
+  size_t open_len = 0, open_size = 0;
+  bool stop = !xml__query_run_init(set, &run);
+  XMLTokenizer tokenizer;
+  xml__tokenizer_init(&tokenizer, data, len);
+  XMLToken token;
+  while (!stop && xml__next_token(&tokenizer, &token)) {
+    if (token.type == XML__TOKEN_START) {
+      if (!xml__query_run_push(set, &run, token.name, token.name_len)) break;
+      size_t depth = run.frames_len - 1;
+      for (size_t a = run.frames[depth]; !stop && a < run.active_len; a++)
+        for (size_t q = set->states[run.active[a]].first_query; !stop && q != XML__QUERY_NONE;
+             q = set->next_query[q]) {
+          if (token.self_closing) {
+            matches++;
+            stop = !callback(q, data + token.start, token.end - token.start, user_data);
+            continue;
+          }
+          if (!xml__query_grow((void **)&open, open_len, &open_size, sizeof(XMLQueryOpen))) {
+            stop = true;
+            break;
+          }
+          open[open_len].start = token.start;
+          open[open_len].depth = depth;
+          open[open_len].query = q;
+          open_len++;
+        }
+      if (token.self_closing) xml__query_run_pop(&run);
+    } else if (token.type == XML__TOKEN_END && run.frames_len > 1) {
+      // Deliver all queries matched by the closed element in order
+      size_t depth = run.frames_len - 1, first = open_len;
+      while (first > 0 && open[first - 1].depth == depth) first--;
+      for (size_t i = first; !stop && i < open_len; i++) {
+        matches++;
+        stop = !callback(open[i].query, data + open[i].start, token.end - open[i].start, user_data);
+      }
+      open_len = first;
+      xml__query_run_pop(&run);
+    }
+  }
+  XML_FREE(NULL, open);
+  xml__query_run_free(&run);
+  return matches;
+}
+
+// ---------- XMLStream ---------- //
+
+// Passes matches of the single query to `XMLStreamCallback`.
+typedef struct {
+  XMLStreamCallback callback;
+  void *user_data;
+} XMLStreamAdapter;
+
+static bool xml__stream_adapter(size_t query_id, const char *element, size_t len, void *user_data) {
+  (void)query_id;
+  XMLStreamAdapter *adapter = (XMLStreamAdapter *)user_data;
+  return adapter->callback(element, len, adapter->user_data);
+}
+
+XML_H_API size_t xml_stream_match(const char *data, size_t len, const char *path, XMLStreamCallback callback,
+                                  void *user_data) {
+  if (!data || !path || !callback) return 0;
+  XMLQuerySet *set = xml_query_set_new();
+  size_t matches = 0;
+  if (set && xml_query_set_add(set, path) != XML__QUERY_NONE) {
+    XMLStreamAdapter adapter = {callback, user_data};
+    matches = xml_query_set_match_stream(set, data, len, xml__stream_adapter, &adapter);
+  }
+  xml_query_set_free(set);
+  return matches;
+}
+
+// ---------- XMLAggregate ---------- //
+
+// Powers of ten that are exact in double
+static const double xml__pow10[] = {1e0,  1e1,  1e2,  1e3,  1e4,  1e5,  1e6,  1e7,  1e8,  1e9,  1e10, 1e11,
+                                    1e12, 1e13, 1e14, 1e15, 1e16, 1e17, 1e18, 1e19, 1e20, 1e21, 1e22};
+
+// Parse `len` bytes of the string as a number without allocating. Surrounding whitespace is ignored.
+// Plain decimals with up to 15 significant digits are converted exactly with one multiplication or
+// division, others fall back to `strtod()`.
+// Returns false if it's not a number.
+static bool xml__parse_number_n(const char *str, size_t len, double *value) {
+  while (len && xml__token_is_space(*str)) str++, len--;
+  while (len && xml__token_is_space(str[len - 1])) len--;
+  if (len == 0) return false;
+  size_t i = 0;
+  bool negative = str[0] == '-';
+  if (str[0] == '-' || str[0] == '+') i++;
+  uint64_t mantissa = 0;
+  size_t digits = 0, fraction = 0;
+  for (; i < len && str[i] >= '0' && str[i] <= '9'; i++, digits++) mantissa = mantissa * 10 + (uint64_t)(str[i] - '0');
+  if (i < len && str[i] == '.')
+    for (i++; i < len && str[i] >= '0' && str[i] <= '9'; i++, digits++, fraction++)
+      mantissa = mantissa * 10 + (uint64_t)(str[i] - '0');
+  if (i == len && digits > 0 && digits <= 15) {
+    // Mantissa and power of ten are exact, so the result is correctly rounded
+    *value = (double)mantissa / xml__pow10[fraction];
+    if (negative) *value = -*value;
+    return true;
+  }
+  char buf[64];
+  if (len >= sizeof(buf)) return false;
+  memcpy(buf, str, len);
+  buf[len] = '\0';
+  return xml__parse_number(buf, value);
+}
+
+// Add value to the aggregate.
+static inline void xml__aggregate_add(XMLAggregate *result, double value) {
+  if (result->values == 0 || value < result->min) result->min = value;
+  if (result->values == 0 || value > result->max) result->max = value;
+  result->sum += value;
+  result->values++;
+}
+
+XML_H_API bool xml_aggregate(const char *data, size_t len, const char *path, const char *attr, unsigned ops,
+                             XMLAggregate *result) {
+  if (!data || !path || !result) return false;
+  memset(result, 0, sizeof(XMLAggregate));
+  XMLQuerySet *set = xml_query_set_new();
+  if (!set || xml_query_set_add(set, path) == XML__QUERY_NONE) {
+    xml_query_set_free(set);
+    return false;
+  }
+  // Values aren't parsed for count only
+  bool need_values = ops & (XML_AGG_SUM | XML_AGG_MIN | XML_AGG_MAX);
+  size_t attr_len = attr ? strlen(attr) : 0;
+  size_t text_depth = 0; // Depth of matched element waiting for it's text. 0 if none.
+  XMLQueryRun run;
+  bool ok = xml__query_run_init(set, &run);
+  XMLTokenizer tokenizer;
+  xml__tokenizer_init(&tokenizer, data, len);
+  XMLToken token;
+  while (ok && xml__next_token(&tokenizer, &token)) {
+    if (token.type == XML__TOKEN_START) {
+      if (!(ok = xml__query_run_push(set, &run, token.name, token.name_len))) break;
+      size_t depth = run.frames_len - 1;
+      bool matched = false;
+      for (size_t a = run.frames[depth]; a < run.active_len; a++)
+        matched |= set->states[run.active[a]].first_query != XML__QUERY_NONE;
+      if (matched) {
+        result->count++;
+        const char *value;
+        size_t value_len;
+        double number;
+        if (need_values && attr) {
+          if (xml__token_attr(&token, attr, attr_len, &value, &value_len) &&
+              xml__parse_number_n(value, value_len, &number))
+            xml__aggregate_add(result, number);
+        } else if (need_values && !token.self_closing) text_depth = depth;
+      }
+      if (token.self_closing) xml__query_run_pop(&run);
+    } else if (token.type == XML__TOKEN_TEXT) {
+      // Text can follow child elements or whitespace, keep waiting for a number until the end tag
+      double number;
+      if (text_depth && text_depth == run.frames_len - 1 && xml__parse_number_n(token.text, token.text_len, &number)) {
+        xml__aggregate_add(result, number);
+        text_depth = 0;
+      }
+    } else if (run.frames_len > 1) {
+      if (text_depth == run.frames_len - 1) text_depth = 0;
+      xml__query_run_pop(&run);
+    }
+  }
+  xml__query_run_free(&run);
+  xml_query_set_free(set);
+  // Keep only requested results
+  if (!(ops & XML_AGG_SUM)) result->sum = 0;
+  if (!(ops & XML_AGG_MIN)) result->min = 0;
+  if (!(ops & XML_AGG_MAX)) result->max = 0;
+  return ok;
+}
+
+// ---------- XMLQuery ---------- //
+
+#define XML__QUERY_ANY UINT32_MAX // Name operand of `*` step
+
+// Instructions. Every step starts with navigation instruction followed by predicates filtering it's result.
+typedef enum {
+  XML__OP_CHILD,      // Children with tag name `a`
+  XML__OP_DESCENDANT, // Descendants with tag name `a`
+  XML__OP_HAS_ATTR,   // Nodes with attribute `a`
+  XML__OP_EQ,         // Nodes with value equal to string `b`
+  XML__OP_NE,         // Nodes with value not equal to string `b`
+  XML__OP_LT,         // Nodes with numeric value less than number `b`
+  XML__OP_LE,         // Nodes with numeric value less than or equal to number `b`
+  XML__OP_GT,         // Nodes with numeric value greater than number `b`
+  XML__OP_GE,         // Nodes with numeric value greater than or equal to number `b`
+} XMLQueryOpcode;
+
+// Value compared by XML__OP_EQ ... XML__OP_GE instructions: attribute `a` or text if `a` is XML__QUERY_ANY.
+typedef struct {
+  uint8_t op;
+  uint32_t a; // Index of name or attribute key in `strings`
+  uint32_t b; // Index of compared value in `strings` or `numbers`
+} XMLQueryInstr;
+
+struct XMLQuery {
+  XMLQueryInstr *code;
+  size_t code_len;
+  size_t *steps; // Offset after the last instruction of every step
+  size_t steps_len;
+  char **strings;
+  size_t strings_len;
+  double *numbers;
+  size_t numbers_len;
+  char *canonical;       // Normalized source. It's prefixes identify results of first steps in the cache.
+  size_t *prefixes;      // Length of canonical prefix after every step
+  uint64_t *prefix_hash; // Hash of canonical prefix after every step
+};
+
+// Cached result of steps of the query evaluated from the node.
+typedef struct {
+  uint64_t hash; // Hash of canonical prefix and the node
+  XMLNode *node; // Node the steps were evaluated from. NULL for empty slot.
+  char *prefix;  // Canonical prefix of the steps
+  XMLNodeSet *set; // Allocated apart from the table, so it stays in place when the table grows
+} XMLQueryCacheEntry;
+
+struct XMLQueryCache {
+  XMLQueryCacheEntry *entries; // Open addressing hash table. Number of slots is a power of two.
+  size_t len;
+  size_t size;
+};
+
+// Query parser state.
+typedef struct {
+  const char *src;
+  size_t pos;
+  XMLQuery *query;
+  XMLString *canonical;
+  size_t code_size, steps_size, strings_size, numbers_size;
+} XMLQueryParser;
+
+static inline void xml__query_skip_space(XMLQueryParser *p) {
+  while (xml__token_is_space(p->src[p->pos])) p->pos++;
+}
+
+static inline bool xml__query_is_name_char(char c) {
+  return c && !xml__token_is_space(c) && !strchr("/[]@=!<>\"'*()", c);
+}
+
+// Add string to the pool. Returns it's index or XML__QUERY_ANY for error.
+static uint32_t xml__query_add_string(XMLQueryParser *p, const char *str, size_t len) {
+  XMLQuery *q = p->query;
+  if (!xml__query_grow((void **)&q->strings, q->strings_len, &p->strings_size, sizeof(char *)))
+    return XML__QUERY_ANY;
+  char *copy = xml__strndup(NULL, str, len);
+  if (!copy) return XML__QUERY_ANY;
+  q->strings[q->strings_len] = copy;
+  return (uint32_t)q->strings_len++;
+}
+
+static bool xml__query_emit(XMLQueryParser *p, uint8_t op, uint32_t a, uint32_t b) {
+  XMLQuery *q = p->query;
+  if (!xml__query_grow((void **)&q->code, q->code_len, &p->code_size, sizeof(XMLQueryInstr))) return false;
+  q->code[q->code_len].op = op;
+  q->code[q->code_len].a = a;
+  q->code[q->code_len].b = b;
+  q->code_len++;
+  return true;
+}
+
+// Parse name or `*`. Returns it's index in strings, XML__QUERY_ANY for `*` or false for error.
+static bool xml__query_parse_name(XMLQueryParser *p, bool allow_any, uint32_t *index) {
+  const char *src = p->src + p->pos;
+  if (allow_any && *src == '*') {
+    p->pos++;
+    xml_string_append_n(p->canonical, "*", 1);
+    *index = XML__QUERY_ANY;
+    return true;
+  }
+  size_t len = 0;
+  while (xml__query_is_name_char(src[len])) len++;
+  if (len == 0) return false;
+  p->pos += len;
+  xml_string_append_n(p->canonical, src, len);
+  *index = xml__query_add_string(p, src, len);
+  return *index != XML__QUERY_ANY;
+}
+
+// Parse predicate `[@key]`, `[@key op value]` or `[text() op value]` after '['.
+static bool xml__query_parse_predicate(XMLQueryParser *p) {
+  XMLQuery *q = p->query;
+  xml__query_skip_space(p);
+  uint32_t key = XML__QUERY_ANY;
+  if (p->src[p->pos] == '@') {
+    p->pos++;
+    xml_string_append_n(p->canonical, "[@", 2);
+    if (!xml__query_parse_name(p, false, &key)) return false;
+  } else if (strncmp(p->src + p->pos, "text()", 6) == 0) {
+    p->pos += 6;
+    xml_string_append_n(p->canonical, "[text()", 7);
+  } else return false;
+  xml__query_skip_space(p);
+  const char *c = p->src + p->pos;
+  if (*c == ']') {
+    p->pos++;
+    xml_string_append_n(p->canonical, "]", 1);
+    return key != XML__QUERY_ANY && xml__query_emit(p, XML__OP_HAS_ATTR, key, 0);
+  }
+  // Operator
+  if (*c == '\0') return false;
+  uint8_t op;
+  size_t op_len = c[1] == '=' ? 2 : 1;
+  if (c[0] == '=') op = XML__OP_EQ, op_len = 1;
+  else if (c[0] == '!' && c[1] == '=') op = XML__OP_NE;
+  else if (c[0] == '<') op = op_len == 2 ? XML__OP_LE : XML__OP_LT;
+  else if (c[0] == '>') op = op_len == 2 ? XML__OP_GE : XML__OP_GT;
+  else return false;
+  xml_string_append_n(p->canonical, c, op_len);
+  p->pos += op_len;
+  xml__query_skip_space(p);
+  c = p->src + p->pos;
+  uint32_t value;
+  if (*c == '"' || *c == '\'') {
+    // String value, compared only for equality
+    const char *end = strchr(c + 1, *c);
+    if (!end || (op != XML__OP_EQ && op != XML__OP_NE)) return false;
+    xml_string_append_n(p->canonical, "\"", 1);
+    xml_string_append_n(p->canonical, c + 1, (size_t)(end - c - 1));
+    xml_string_append_n(p->canonical, "\"", 1);
+    value = xml__query_add_string(p, c + 1, (size_t)(end - c - 1));
+    if (value == XML__QUERY_ANY) return false;
+    p->pos += (size_t)(end - c) + 1;
+  } else {
+    // Number value. Equality compares text, others compare numbers.
+    size_t len = 0;
+    while (c[len] && c[len] != ']' && !xml__token_is_space(c[len])) len++;
+    double number;
+    if (!xml__parse_number_n(c, len, &number)) return false;
+    xml_string_append_n(p->canonical, c, len);
+    p->pos += len;
+    if (op == XML__OP_EQ || op == XML__OP_NE) {
+      value = xml__query_add_string(p, c, len);
+      if (value == XML__QUERY_ANY) return false;
+    } else {
+      if (!xml__query_grow((void **)&q->numbers, q->numbers_len, &p->numbers_size, sizeof(double))) return false;
+      q->numbers[q->numbers_len] = number;
+      value = (uint32_t)q->numbers_len++;
+    }
+  }
+  xml__query_skip_space(p);
+  if (p->src[p->pos] != ']') return false;
+  p->pos++;
+  xml_string_append_n(p->canonical, "]", 1);
+  return xml__query_emit(p, op, key, value);
+}
+
+XML_H_API XMLQuery *xml_query_compile(const char *expr) {
+  if (!expr) return NULL;
+  XMLQueryParser p = {0};
+  p.src = expr;
+  p.query = (XMLQuery *)XML_CALLOC_FUNC(1, sizeof(XMLQuery));
+  p.canonical = xml_string_new();
+  bool ok = p.query && p.canonical;
+  size_t prefixes_size = 0, hashes_size = 0;
+  xml__query_skip_space(&p);
+  while (ok && expr[p.pos]) {
+    // Step separator. Leading '/' is optional, paths are relative like in xml_node_find_tag().
+    uint8_t op = XML__OP_CHILD;
+    if (expr[p.pos] == '/') {
+      p.pos++;
+      if (expr[p.pos] == '/') {
+        p.pos++;
+        op = XML__OP_DESCENDANT;
+      }
+    } else if (p.query->steps_len > 0) ok = false;
+    xml_string_append_n(p.canonical, op == XML__OP_DESCENDANT ? "//" : "/", op == XML__OP_DESCENDANT ? 2 : 1);
+    uint32_t name;
+    ok = ok && xml__query_parse_name(&p, true, &name) && xml__query_emit(&p, op, name, 0);
+    while (ok && expr[p.pos] == '[') {
+      p.pos++;
+      ok = xml__query_parse_predicate(&p);
+    }
+    xml__query_skip_space(&p);
+    XMLQuery *q = p.query;
+    ok = ok && xml__query_grow((void **)&q->steps, q->steps_len, &p.steps_size, sizeof(size_t)) &&
+         xml__query_grow((void **)&q->prefixes, q->steps_len, &prefixes_size, sizeof(size_t)) &&
+         xml__query_grow((void **)&q->prefix_hash, q->steps_len, &hashes_size, sizeof(uint64_t));
+    if (!ok) break;
+    q->steps[q->steps_len] = q->code_len;
+    q->prefixes[q->steps_len] = p.canonical->len;
+    q->prefix_hash[q->steps_len] = xml__hash_n(p.canonical->str, p.canonical->len);
+    q->steps_len++;
+  }
+  if (!ok || !p.query->steps_len) {
+    xml_string_free(p.canonical);
+    xml_query_free(p.query);
+    return NULL;
+  }
+  p.query->canonical = xml_string_steal(p.canonical);
+  return p.query;
+}
+
+XML_H_API void xml_query_free(XMLQuery *query) {
+  if (!query) return;
+  for (size_t i = 0; i < query->strings_len; i++) XML_FREE(NULL, query->strings[i]);
+  XML_FREE(NULL, query->strings);
+  XML_FREE(NULL, query->code);
+  XML_FREE(NULL, query->steps);
+  XML_FREE(NULL, query->numbers);
+  XML_FREE(NULL, query->canonical);
+  XML_FREE(NULL, query->prefixes);
+  XML_FREE(NULL, query->prefix_hash);
+  XML_FREE(NULL, query);
+}
+
+XML_H_API XMLQueryCache *xml_query_cache_new() {
+  return (XMLQueryCache *)XML_CALLOC_FUNC(1, sizeof(XMLQueryCache));
+}
+
+XML_H_API void xml_query_cache_clear(XMLQueryCache *cache) {
+  if (!cache) return;
+  for (size_t i = 0; i < cache->size; i++) {
+    XMLQueryCacheEntry *entry = &cache->entries[i];
+    if (!entry->node) continue;
+    XML_FREE(NULL, entry->prefix);
+    XML_FREE(NULL, entry->set->nodes);
+    XML_FREE(NULL, entry->set);
+  }
+  XML_FREE(NULL, cache->entries);
+  cache->entries = NULL;
+  cache->len = cache->size = 0;
+}
+
+XML_H_API void xml_query_cache_free(XMLQueryCache *cache) {
+  xml_query_cache_clear(cache);
+  XML_FREE(NULL, cache);
+}
+
+static inline uint64_t xml__query_cache_hash(XMLNode *node, uint64_t prefix_hash) {
+  return prefix_hash ^ ((uint64_t)(uintptr_t)node * 0x9E3779B97F4A7C15ull);
+}
+
+// Find slot of the cached result or empty slot where it should be inserted.
+static XMLQueryCacheEntry *xml__query_cache_slot(XMLQueryCache *cache, XMLNode *node, const char *prefix,
+                                                 size_t len, uint64_t hash) {
+  size_t mask = cache->size - 1;
+  for (size_t i = hash & mask;; i = (i + 1) & mask) {
+    XMLQueryCacheEntry *entry = &cache->entries[i];
+    if (!entry->node) return entry;
+    if (entry->hash == hash && entry->node == node && strncmp(entry->prefix, prefix, len) == 0 &&
+        entry->prefix[len] == '\0')
+      return entry;
+  }
+}
+
+// Get cached result of the first `steps` steps. Returns NULL if not cached.
+static XMLNodeSet *xml__query_cache_get(XMLQueryCache *cache, XMLQuery *query, XMLNode *node, size_t steps) {
+  if (!cache->len) return NULL;
+  size_t len = query->prefixes[steps - 1];
+  XMLQueryCacheEntry *entry = xml__query_cache_slot(
+      cache, node, query->canonical, len, xml__query_cache_hash(node, query->prefix_hash[steps - 1]));
+  return entry->node ? entry->set : NULL;
+}
+
+// Cache result of the first `steps` steps. Takes ownership of `set` nodes.
+// Returns cached set or NULL for error (in that case nodes are freed).
+static XMLNodeSet *xml__query_cache_put(XMLQueryCache *cache, XMLQuery *query, XMLNode *node, size_t steps,
+                                        XMLNodeSet set) {
+  // Keep load factor under 3/4
+  if ((cache->len + 1) * 4 > cache->size * 3) {
+    size_t size = cache->size ? cache->size * 2 : 64;
+    XMLQueryCacheEntry *entries = (XMLQueryCacheEntry *)XML_CALLOC_FUNC(size, sizeof(XMLQueryCacheEntry));
+    if (!entries) {
+      XML_FREE(NULL, set.nodes);
+      return NULL;
+    }
+    XMLQueryCacheEntry *old = cache->entries;
+    size_t old_size = cache->size;
+    cache->entries = entries;
+    cache->size = size;
+    for (size_t i = 0; i < old_size; i++)
+      if (old[i].node)
+        *xml__query_cache_slot(cache, old[i].node, old[i].prefix, strlen(old[i].prefix), old[i].hash) = old[i];
+    XML_FREE(NULL, old);
+  }
+  size_t len = query->prefixes[steps - 1];
+  uint64_t hash = xml__query_cache_hash(node, query->prefix_hash[steps - 1]);
+  XMLQueryCacheEntry *entry = xml__query_cache_slot(cache, node, query->canonical, len, hash);
+  entry->prefix = xml__strndup(NULL, query->canonical, len);
+  entry->set = (XMLNodeSet *)XML_CALLOC_FUNC(1, sizeof(XMLNodeSet));
+  if (!entry->prefix || !entry->set) {
+    XML_FREE(NULL, entry->prefix);
+    XML_FREE(NULL, entry->set);
+    XML_FREE(NULL, set.nodes);
+    entry->prefix = NULL;
+    entry->set = NULL;
+    return NULL;
+  }
+  entry->hash = hash;
+  entry->node = node;
+  *entry->set = set;
+  cache->len++;
+  return entry->set;
+}
+
+// Growable node set being built.
+typedef struct {
+  XMLNodeSet set;
+  size_t size;
+  bool ok;
+} XMLQuerySetBuilder;
+
+static inline void xml__query_set_add(XMLQuerySetBuilder *builder, XMLNode *node) {
+  if (!builder->ok) return;
+  if (!xml__query_grow((void **)&builder->set.nodes, builder->set.len, &builder->size, sizeof(XMLNode *))) {
+    builder->ok = false;
+    return;
+  }
+  builder->set.nodes[builder->set.len++] = node;
+}
+
+static inline bool xml__query_name_is(XMLQuery *query, uint32_t name, XMLNode *node) {
+  return node->tag && (name == XML__QUERY_ANY || strcmp(node->tag, query->strings[name]) == 0);
+}
+
+// Add descendants named `name` to the builder. Subtrees that tag filters rule out by `bits` are skipped.
+static void xml__query_descendants(XMLQuery *query, uint32_t name, uint64_t bits, XMLNode *node,
+                                   XMLQuerySetBuilder *builder) {
+  for (size_t i = 0; i < node->children->len && builder->ok; i++) {
+    XMLNode *child = (XMLNode *)node->children->data[i];
+    if ((child->tag_filter & bits) != bits) continue;
+    if (xml__query_name_is(query, name, child)) xml__query_set_add(builder, child);
+    xml__query_descendants(query, name, bits, child, builder);
+  }
+}
+
+// Check predicate instruction on the node.
+static bool xml__query_test(XMLQuery *query, const XMLQueryInstr *instr, XMLNode *node) {
+  const char *value = instr->a == XML__QUERY_ANY ? (node->text ? node->text : "")
+                                                  : xml_node_attr(node, query->strings[instr->a]);
+  if (!value) return false;
+  double number;
+  switch (instr->op) {
+  case XML__OP_HAS_ATTR: return true;
+  case XML__OP_EQ: return strcmp(value, query->strings[instr->b]) == 0;
+  case XML__OP_NE: return strcmp(value, query->strings[instr->b]) != 0;
+  default: break;
+  }
+  if (!xml__parse_number(value, &number)) return false;
+  double operand = query->numbers[instr->b];
+  switch (instr->op) {
+  case XML__OP_LT: return number < operand;
+  case XML__OP_LE: return number <= operand;
+  case XML__OP_GT: return number > operand;
+  default: return number >= operand;
+  }
+}
+
+// Whether `node` is inside the subtree of `ancestor`.
+static bool xml__query_inside(XMLNode *node, XMLNode *ancestor) {
+  for (node = node->parent; node; node = node->parent)
+    if (node == ancestor) return true;
+  return false;
+}
+
+// Input node whose children are being added to the result.
+typedef struct {
+  XMLNode *node;
+  size_t next; // Next child to add
+} XMLQueryChildFrame;
+
+// Add matching children of the frame's node up to and including `last` (all if NULL).
+static void xml__query_children_until(XMLQuery *query, uint32_t name, XMLQueryChildFrame *frame, XMLNode *last,
+                                      XMLQuerySetBuilder *builder) {
+  XMLList *children = frame->node->children;
+  // Branches only move forward, `last` can only be the branch added last time
+  if (last && frame->next && children->data[frame->next - 1] == last) return;
+  while (frame->next < children->len) {
+    XMLNode *child = (XMLNode *)children->data[frame->next++];
+    if (xml__query_name_is(query, name, child)) xml__query_set_add(builder, child);
+    if (child == last) break;
+  }
+}
+
+// Add children of all input nodes in document order. Input in document order can contain nodes nested in other
+// input nodes (after descendant steps), so children of outer nodes are added only up to the branch with the next
+// input node, and the rest once that branch is done.
+static void xml__query_children(XMLQuery *query, uint32_t name, const XMLNodeSet *input,
+                                XMLQuerySetBuilder *builder) {
+  XMLQueryChildFrame *stack = NULL;
+  size_t stack_len = 0, stack_size = 0;
+  for (size_t i = 0; i < input->len && builder->ok; i++) {
+    XMLNode *node = input->nodes[i];
+    while (stack_len && !xml__query_inside(node, stack[stack_len - 1].node))
+      xml__query_children_until(query, name, &stack[--stack_len], NULL, builder);
+    if (stack_len) {
+      XMLNode *branch = node;
+      while (branch->parent != stack[stack_len - 1].node) branch = branch->parent;
+      xml__query_children_until(query, name, &stack[stack_len - 1], branch, builder);
+    }
+    if (!xml__query_grow((void **)&stack, stack_len, &stack_size, sizeof(XMLQueryChildFrame))) {
+      builder->ok = false;
+      break;
+    }
+    stack[stack_len].node = node;
+    stack[stack_len++].next = 0;
+  }
+  while (stack_len && builder->ok) xml__query_children_until(query, name, &stack[--stack_len], NULL, builder);
+  XML_FREE(NULL, stack);
+}
+
+// Run instructions of the step on the input set. Input and result are in document order without duplicates.
+static XMLNodeSet xml__query_step_run(XMLQuery *query, size_t step, const XMLNodeSet *input, bool *ok) {
+  size_t start = step ? query->steps[step - 1] : 0, end = query->steps[step];
+  const XMLQueryInstr *nav = &query->code[start];
+  XMLQuerySetBuilder builder = {{NULL, 0}, 0, true};
+  if (nav->op == XML__OP_DESCENDANT) {
+    // Descendants of nested input nodes are already covered by the outer one
+    uint64_t bits = nav->a == XML__QUERY_ANY ? 0 : xml__tag_bits(query->strings[nav->a]);
+    XMLNode *outer = NULL;
+    for (size_t i = 0; i < input->len && builder.ok; i++) {
+      if (outer && xml__query_inside(input->nodes[i], outer)) continue;
+      outer = input->nodes[i];
+      xml__query_descendants(query, nav->a, outer->tag_filter ? bits : 0, outer, &builder);
+    }
+  } else {
+    xml__query_children(query, nav->a, input, &builder);
+  }
+  // Filter in place
+  XMLNodeSet set = builder.set;
+  for (size_t pc = start + 1; pc < end && builder.ok; pc++) {
+    size_t len = 0;
+    for (size_t i = 0; i < set.len; i++)
+      if (xml__query_test(query, &query->code[pc], set.nodes[i])) set.nodes[len++] = set.nodes[i];
+    set.len = len;
+  }
+  *ok = builder.ok;
+  return set;
+}
+
+XML_H_API const XMLNodeSet *xml_query_eval(XMLQuery *query, XMLNode *node, XMLQueryCache *cache) {
+  if (!query || !node || !cache) return NULL;
+  // Continue from the longest cached prefix
+  size_t step = query->steps_len;
+  XMLNodeSet *set = NULL;
+  for (; step > 0 && !set; step--) set = xml__query_cache_get(cache, query, node, step);
+  if (set) {
+    step++;
+    if (step == query->steps_len) return set;
+  }
+  XMLNode *context[1] = {node};
+  XMLNodeSet input = {context, 1};
+  if (set) input = *set;
+  for (; step < query->steps_len; step++) {
+    bool ok;
+    XMLNodeSet result = xml__query_step_run(query, step, &input, &ok);
+    if (!ok) {
+      XML_FREE(NULL, result.nodes);
+      return NULL;
+    }
+    set = xml__query_cache_put(cache, query, node, step + 1, result);
+    if (!set) return NULL;
+    input = *set;
+  }
+  return set;
+}
+
+// ---------- Parallel traversal ---------- //
+
+#if !defined(XML_NO_THREADS) && !defined(_WIN32)
+#include <unistd.h>
+#endif // !XML_NO_THREADS && !_WIN32
+
+#define XML__PARALLEL_GRAIN_MIN 256 // Smallest numbered subtree worth a separate task
+#define XML__PARALLEL_SPLIT 4       // Unnumbered subtrees are split while the task queue is shorter than this
+
+// Number of threads to use when 0 is given.
+static size_t xml__thread_count(size_t nthreads) {
+#ifdef XML_NO_THREADS
+  (void)nthreads;
+  return 1;
+#else
+  if (nthreads) return nthreads;
+#ifdef _SC_NPROCESSORS_ONLN
+  long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+  if (cpus > 0) return (size_t)cpus;
+#endif // _SC_NPROCESSORS_ONLN
+  return 1;
+#endif // XML_NO_THREADS
+}
+
+// Run `fn(arg)` for every argument in `args` (`nthreads` items of `arg_size` bytes), each in it's own thread.
+// The first one runs in the calling thread. Returns when all of them are done.
+// If a thread can't be created it's argument is skipped, so `fn` must not rely on all of them running.
+static void xml__run_threads(void *(*fn)(void *), void *args, size_t nthreads, size_t arg_size) {
+#ifndef XML_NO_THREADS
+  pthread_t *threads = nthreads > 1 ? (pthread_t *)XML_CALLOC_FUNC(nthreads, sizeof(pthread_t)) : NULL;
+  bool *started = nthreads > 1 ? (bool *)XML_CALLOC_FUNC(nthreads, sizeof(bool)) : NULL;
+  if (threads && started) {
+    for (size_t i = 1; i < nthreads; i++)
+      started[i] = pthread_create(&threads[i], NULL, fn, (char *)args + i * arg_size) == 0;
+  }
+  fn(args);
+  if (threads && started) {
+    for (size_t i = 1; i < nthreads; i++)
+      if (started[i]) pthread_join(threads[i], NULL);
+  }
+  XML_FREE(NULL, threads);
+  XML_FREE(NULL, started);
+#else
+  (void)nthreads;
+  (void)arg_size;
+  fn(args);
+#endif // XML_NO_THREADS
+}
+
+// Visit subtree in the calling thread. Returns false if `fn` stopped the traversal.
+static bool xml__for_each_serial(XMLNode *node, XMLNodeFilter filter, XMLNodeVisitor fn, void *user_data) {
+  if ((!filter || filter(node, user_data)) && !fn(node, user_data)) return false;
+  for (size_t i = 0; i < node->children->len; i++)
+    if (!xml__for_each_serial((XMLNode *)node->children->data[i], filter, fn, user_data)) return false;
+  return true;
+}
+
+#ifndef XML_NO_THREADS
+// Per-thread deque of subtrees to visit. The owner takes the newest one, thieves take the oldest one
+// (the biggest, as they were split off closer to the root).
+typedef struct {
+  pthread_mutex_t mutex;
+  XMLNode **tasks;
+  size_t head; // First task
+  size_t tail; // Past the last task
+  size_t size;
+  size_t len;  // Number of tasks, readable without the lock
+} XMLTaskQueue;
+
+typedef struct {
+  XMLNodeFilter filter;
+  XMLNodeVisitor fn;
+  void *user_data;
+  XMLTaskQueue *queues;
+  size_t nthreads;
+  size_t stamp;   // Numbering pass of the tree. 0 if subtree sizes are not available.
+  size_t grain;   // Smallest numbered subtree to split off
+  size_t pending; // Tasks queued or being visited
+  bool stop;
+  // Idle workers sleep until new tasks are pushed or the run ends
+  pthread_mutex_t mutex;
+  pthread_cond_t wake;
+  size_t pushes;   // Number of pushed tasks
+  size_t sleepers; // Number of sleeping workers
+} XMLParallelRun;
+
+typedef struct {
+  XMLParallelRun *run;
+  size_t idx;
+} XMLParallelWorker;
+
+static bool xml__task_push(XMLTaskQueue *queue, XMLNode *node) {
+  pthread_mutex_lock(&queue->mutex);
+  if (queue->tail == queue->size && queue->head > 0) {
+    memmove(queue->tasks, queue->tasks + queue->head, (queue->tail - queue->head) * sizeof(XMLNode *));
+    queue->tail -= queue->head;
+    queue->head = 0;
+  }
+  bool ok = xml__query_grow((void **)&queue->tasks, queue->tail, &queue->size, sizeof(XMLNode *));
+  if (ok) queue->tasks[queue->tail++] = node;
+  XML__ATOMIC_STORE(&queue->len, queue->tail - queue->head);
+  pthread_mutex_unlock(&queue->mutex);
+  return ok;
+}
+
+static XMLNode *xml__task_pop(XMLTaskQueue *queue, bool steal) {
+  pthread_mutex_lock(&queue->mutex);
+  XMLNode *node = NULL;
+  if (queue->head < queue->tail) node = steal ? queue->tasks[queue->head++] : queue->tasks[--queue->tail];
+  if (queue->head == queue->tail) queue->head = queue->tail = 0;
+  XML__ATOMIC_STORE(&queue->len, queue->tail - queue->head);
+  pthread_mutex_unlock(&queue->mutex);
+  return node;
+}
+
+// Wake one sleeping worker for a new task, or all of them when the run ends.
+static void xml__parallel_wake(XMLParallelRun *run, bool all) {
+  if (!XML__ATOMIC_LOAD(&run->sleepers)) return;
+  pthread_mutex_lock(&run->mutex);
+  if (all) pthread_cond_broadcast(&run->wake);
+  else pthread_cond_signal(&run->wake);
+  pthread_mutex_unlock(&run->mutex);
+}
+
+// Sleep until tasks were pushed after `pushes` was read or the run ends.
+static void xml__parallel_sleep(XMLParallelRun *run, size_t pushes) {
+  pthread_mutex_lock(&run->mutex);
+  // Pusher checks sleepers after counting the push, so either it sees us or we see the push
+  XML__ATOMIC_ADD(&run->sleepers, 1);
+  while (XML__ATOMIC_LOAD(&run->pushes) == pushes && XML__ATOMIC_LOAD(&run->pending) && !XML__ATOMIC_LOAD(&run->stop))
+    pthread_cond_wait(&run->wake, &run->mutex);
+  XML__ATOMIC_SUB(&run->sleepers, 1);
+  pthread_mutex_unlock(&run->mutex);
+}
+
+// Whether the child should become a task instead of being visited right away.
+static bool xml__task_split(XMLParallelRun *run, XMLTaskQueue *queue, XMLNode *child) {
+  if (!child->children->len) return false;
+  if (run->stamp && child->order_stamp == run->stamp) return child->subtree_size >= run->grain;
+  return XML__ATOMIC_LOAD(&queue->len) < XML__PARALLEL_SPLIT;
+}
+
+static void xml__task_visit(XMLParallelRun *run, XMLTaskQueue *queue, XMLNode *node) {
+  if (XML__ATOMIC_LOAD(&run->stop)) return;
+  if ((!run->filter || run->filter(node, run->user_data)) && !run->fn(node, run->user_data)) {
+    XML__ATOMIC_STORE(&run->stop, true);
+    xml__parallel_wake(run, true);
+    return;
+  }
+  for (size_t i = 0; i < node->children->len; i++) {
+    XMLNode *child = (XMLNode *)node->children->data[i];
+    if (xml__task_split(run, queue, child)) {
+      XML__ATOMIC_ADD(&run->pending, 1);
+      if (xml__task_push(queue, child)) {
+        XML__ATOMIC_ADD(&run->pushes, 1);
+        xml__parallel_wake(run, false);
+        continue;
+      }
+      XML__ATOMIC_SUB(&run->pending, 1);
+    }
+    xml__task_visit(run, queue, child);
   }
 }
 
-static void xml__parse_tag_inner_text(const char *xml, size_t *idx, XMLNode **curr_node) {
-  size_t text_start = *idx;
-  while (xml[*idx] != '<' && xml[*idx] != '\0') (*idx)++;
-  if (*idx > text_start) (*curr_node)->text = xml__decode_entities(xml + text_start, *idx - text_start);
+static void *xml__parallel_worker(void *arg) {
+  XMLParallelWorker *worker = (XMLParallelWorker *)arg;
+  XMLParallelRun *run = worker->run;
+  XMLTaskQueue *own = &run->queues[worker->idx];
+  while (XML__ATOMIC_LOAD(&run->pending) && !XML__ATOMIC_LOAD(&run->stop)) {
+    size_t pushes = XML__ATOMIC_LOAD(&run->pushes);
+    XMLNode *node = xml__task_pop(own, false);
+    for (size_t i = 1; !node && i < run->nthreads; i++)
+      node = xml__task_pop(&run->queues[(worker->idx + i) % run->nthreads], true);
+    if (!node) {
+      xml__parallel_sleep(run, pushes);
+      continue;
+    }
+    xml__task_visit(run, own, node);
+    if (XML__ATOMIC_SUB(&run->pending, 1) == 0) xml__parallel_wake(run, true);
+  }
+  return NULL;
 }
+#endif // XML_NO_THREADS
 
-// Parse start tag.
-// Returns false if the tag is self-closing like: <tag />
-// Call continue if returns false.
-static bool xml__parse_tag(const char *xml, size_t *idx, XMLNode **curr_node) {
-  xml__skip_whitespace(xml, idx);
-  if (xml__skip_tags(xml, idx)) return false;
-  // End tag </tag>
-  if (xml[*idx] == '/') {
-    xml__parse_end_tag(xml, idx, curr_node);
-    return false;
+XML_H_API bool xml_node_parallel_for_each(XMLNode *root, XMLNodeFilter filter, XMLNodeVisitor fn, void *user_data,
+                                          size_t nthreads) {
+  if (!root || !fn) return true;
+  nthreads = xml__thread_count(nthreads);
+#ifndef XML_NO_THREADS
+  size_t stamp = root->order_stamp;
+  if (stamp && root->subtree_size < 2 * XML__PARALLEL_GRAIN_MIN) nthreads = 1;
+  if (nthreads > 1) {
+    XMLParallelRun run = {0};
+    run.filter = filter;
+    run.fn = fn;
+    run.user_data = user_data;
+    run.nthreads = nthreads;
+    run.stamp = stamp;
+    run.grain = stamp ? root->subtree_size / (nthreads * 8) : 0;
+    if (run.grain < XML__PARALLEL_GRAIN_MIN) run.grain = XML__PARALLEL_GRAIN_MIN;
+    run.queues = (XMLTaskQueue *)XML_CALLOC_FUNC(nthreads, sizeof(XMLTaskQueue));
+    XMLParallelWorker *workers = (XMLParallelWorker *)XML_CALLOC_FUNC(nthreads, sizeof(XMLParallelWorker));
+    if (run.queues && workers) {
+      pthread_mutex_init(&run.mutex, NULL);
+      pthread_cond_init(&run.wake, NULL);
+      for (size_t i = 0; i < nthreads; i++) {
+        pthread_mutex_init(&run.queues[i].mutex, NULL);
+        workers[i].run = &run;
+        workers[i].idx = i;
+      }
+      run.pending = 1;
+      if (xml__task_push(&run.queues[0], root)) {
+        xml__run_threads(xml__parallel_worker, workers, nthreads, sizeof(XMLParallelWorker));
+      } else {
+        run.pending = 0;
+        run.stop = !xml__for_each_serial(root, filter, fn, user_data);
+      }
+      for (size_t i = 0; i < nthreads; i++) {
+        pthread_mutex_destroy(&run.queues[i].mutex);
+        XML_FREE(NULL, run.queues[i].tasks);
+      }
+      pthread_mutex_destroy(&run.mutex);
+      pthread_cond_destroy(&run.wake);
+      XML_FREE(NULL, run.queues);
+      XML_FREE(NULL, workers);
+      return !run.stop;
+    }
+    XML_FREE(NULL, run.queues);
+    XML_FREE(NULL, workers);
   }
-  // Create new node with current curr_node as parent
-  *curr_node = xml_node_new(*curr_node, NULL, NULL);
-  // Start tag <tag...>
-  xml__parse_tag_name(xml, idx, curr_node);
-  // Parse attributes
-  if (xml[*idx] != '\0' && isspace(xml[*idx])) xml__parse_tag_attributes(xml, idx, curr_node);
-  // Self-closing tag <tag ... />
-  if (xml[*idx] == '/') {
-    (*idx)++; // Skip '/'
-    while (xml[*idx] != '>' && xml[*idx] != '\0') (*idx)++;
-    if (xml[*idx] == '\0') return false;
-    (*idx)++; // Consume '>'
-    *curr_node = (*curr_node)->parent;
+#endif // XML_NO_THREADS
+  return xml__for_each_serial(root, filter, fn, user_data);
+}
+
+// ---------- Map-reduce ---------- //
+
+#define XML__MAP_CHUNKS_PER_THREAD 16 // Chunks of sources per thread, so threads that got big documents can lag
+
+typedef struct {
+  const XMLSource *sources;
+  size_t n;
+  XMLMapCallback map_fn;
+  XMLReduceCallback reduce_fn;
+  void *user_data;
+  void **partials; // Result of every chunk
+  size_t chunks;   // Number of chunks
+  size_t chunk;    // Sources per chunk
+  size_t next;     // Next chunk (map) or pair (reduce) to take
+  size_t stride;   // Distance between paired partial results in the current reduce level
+} XMLMapReduce;
+
+// Combine two partial results, skipping NULLs.
+static void *xml__reduce_pair(XMLMapReduce *job, void *left, void *right) {
+  if (!left) return right;
+  if (!right) return left;
+  return job->reduce_fn(left, right, job->user_data);
+}
+
+// Load source into `*buffer` as '\0'-terminated string. Buffer is grown as needed and reused between calls.
+static bool xml__source_load(const XMLSource *source, char **buffer, size_t *size) {
+  FILE *file = NULL;
+  size_t len = source->len;
+  if (source->path) {
+    file = fopen(source->path, "rb");
+    if (!file) return false;
+    long file_size = fseek(file, 0, SEEK_END) == 0 ? ftell(file) : -1;
+    if (file_size < 0 || fseek(file, 0, SEEK_SET) != 0) {
+      fclose(file);
+      return false;
+    }
+    len = (size_t)file_size;
+  } else if (!source->data) {
     return false;
   }
-  // Start tag <tag ... >
-  else if (xml[*idx] == '>') {
-    (*idx)++; // Consume '>'
-    xml__skip_whitespace(xml, idx);
-    xml__parse_tag_inner_text(xml, idx, curr_node);
-    // If the next character is '<', parse the next tag
-    if (xml[*idx] == '<') {
-      (*idx)++; // Consume '<'
-      return xml__parse_tag(xml, idx, curr_node);
+  if (len + 1 > *size) {
+    char *grown = (char *)XML_REALLOC_FUNC(*buffer, len + 1);
+    if (!grown) {
+      if (file) fclose(file);
+      return false;
     }
-    return true;
+    *buffer = grown;
+    *size = len + 1;
   }
-  xml__skip_whitespace(xml, idx);
+  if (file) {
+    size_t bytes_read = fread(*buffer, 1, len, file);
+    fclose(file);
+    if (bytes_read != len) return false;
+  } else {
+    memcpy(*buffer, source->data, len);
+  }
+  (*buffer)[len] = '\0';
   return true;
 }
 
-XML_H_API XMLNode *xml_parse_string(const char *xml) {
-  XMLNode *root = xml_node_new(NULL, NULL, NULL);
-  XMLNode *curr_node = root;
-  size_t idx = 0;
-  while (xml[idx] != '\0') {
-    xml__skip_whitespace(xml, &idx);
-    // Parse tag
-    if (xml[idx] == '<') {
-      idx++;
-      xml__skip_whitespace(xml, &idx);
-      if (xml__skip_tags(xml, &idx)) continue;
-      if (!xml__parse_tag(xml, &idx, &curr_node)) continue;
+static void *xml__map_worker(void *arg) {
+  XMLMapReduce *job = *(XMLMapReduce **)arg;
+  char *buffer = NULL;
+  size_t size = 0;
+  for (;;) {
+    size_t chunk = XML__ATOMIC_ADD(&job->next, 1) - 1;
+    if (chunk >= job->chunks) break;
+    size_t end = (chunk + 1) * job->chunk < job->n ? (chunk + 1) * job->chunk : job->n;
+    void *result = NULL;
+    for (size_t idx = chunk * job->chunk; idx < end; idx++) {
+      XMLNode *doc = NULL;
+      if (xml__source_load(&job->sources[idx], &buffer, &size))
+        doc = xml_parse_string_with_allocator(buffer, xml_pool_allocator());
+      void *mapped = job->map_fn(idx, doc, job->user_data);
+      xml_node_free(doc);
+      result = xml__reduce_pair(job, result, mapped);
     }
-    idx++;
+    job->partials[chunk] = result;
   }
-  return root;
+  XML_FREE(NULL, buffer);
+  return NULL;
 }
 
-XML_H_API XMLNode *xml_parse_file(const char *path) {
-  FILE *file = fopen(path, "rb");
-  if (!file) return NULL;
-  fseek(file, 0, SEEK_END);
-  size_t file_size = ftell(file);
-  fseek(file, 0, SEEK_SET);
-  char *buffer = (char *)XML_CALLOC_FUNC(1, file_size + 1);
-  if (!buffer) {
-    fclose(file);
-    return NULL;
+static void *xml__reduce_worker(void *arg) {
+  XMLMapReduce *job = *(XMLMapReduce **)arg;
+  for (;;) {
+    size_t left = (XML__ATOMIC_ADD(&job->next, 1) - 1) * job->stride * 2;
+    if (left + job->stride >= job->chunks) break;
+    size_t right = left + job->stride;
+    job->partials[left] = xml__reduce_pair(job, job->partials[left], job->partials[right]);
+    job->partials[right] = NULL;
   }
-  size_t bytes_read = fread(buffer, 1, file_size, file);
-  if (bytes_read != file_size) {
-    XML_FREE(buffer);
-    fclose(file);
+  return NULL;
+}
+
+XML_H_API void *xml_map_reduce(const XMLSource *sources, size_t n, XMLMapCallback map_fn, XMLReduceCallback reduce_fn,
+                               void *user_data, size_t nthreads) {
+  if (!sources || !n || !map_fn || !reduce_fn) return NULL;
+  nthreads = xml__thread_count(nthreads);
+  XMLMapReduce job = {0};
+  job.sources = sources;
+  job.n = n;
+  job.map_fn = map_fn;
+  job.reduce_fn = reduce_fn;
+  job.user_data = user_data;
+  job.chunks = nthreads * XML__MAP_CHUNKS_PER_THREAD < n ? nthreads * XML__MAP_CHUNKS_PER_THREAD : n;
+  job.chunk = (n + job.chunks - 1) / job.chunks;
+  job.chunks = (n + job.chunk - 1) / job.chunk;
+  if (nthreads > job.chunks) nthreads = job.chunks;
+  job.partials = (void **)XML_CALLOC_FUNC(job.chunks, sizeof(void *));
+  XMLMapReduce **args = (XMLMapReduce **)XML_CALLOC_FUNC(nthreads, sizeof(XMLMapReduce *));
+  if (!job.partials || !args) {
+    XML_FREE(NULL, job.partials);
+    XML_FREE(NULL, args);
     return NULL;
   }
-  buffer[file_size] = '\0';
-  fclose(file);
-  XMLNode *node = xml_parse_string(buffer);
-  XML_FREE(buffer);
-  return node;
+  for (size_t i = 0; i < nthreads; i++) args[i] = &job;
+  xml__run_threads(xml__map_worker, args, nthreads, sizeof(XMLMapReduce *));
+  // Tree reduce, one level at a time
+  for (job.stride = 1; job.stride < job.chunks; job.stride *= 2) {
+    size_t pairs = job.chunks / (job.stride * 2) + (job.chunks % (job.stride * 2) > job.stride);
+    job.next = 0;
+    xml__run_threads(xml__reduce_worker, args, nthreads < pairs ? nthreads : pairs, sizeof(XMLMapReduce *));
+  }
+  void *result = job.partials[0];
+  XML_FREE(NULL, job.partials);
+  XML_FREE(NULL, args);
+  return result;
 }
 
-XML_H_API void xml_node_serialize(XMLNode *node, XMLString *str) {
-  if (!node || !str) return;
+// ---------- XMLIovSink ---------- //
+
+#ifndef _WIN32
+
+#include <errno.h>
+#include <unistd.h>
 
+XML_H_API void xml_iov_sink_init(XMLIovSink *sink, int fd) {
+  if (!sink) return;
+  memset(sink, 0, sizeof(XMLIovSink));
+  sink->fd = fd;
+}
+
+XML_H_API bool xml_iov_sink_flush(XMLIovSink *sink) {
+  if (!sink || sink->error) return false;
+  struct iovec *iov = sink->iov;
+  size_t len = sink->len;
+  while (len > 0) {
+    ssize_t written = writev(sink->fd, iov, (int)len);
+    if (written < 0) {
+      if (errno == EINTR) continue;
+      sink->error = true;
+      return false;
+    }
+    sink->written += (size_t)written;
+    // Skip fully written entries and advance partially written one
+    while (len > 0 && (size_t)written >= iov->iov_len) {
+      written -= iov->iov_len;
+      iov++;
+      len--;
+    }
+    if (len > 0) {
+      iov->iov_base = (char *)iov->iov_base + written;
+      iov->iov_len -= written;
+    }
+  }
+  sink->len = 0;
+  return true;
+}
+
+// Add entry pointing to `len` bytes of `data`.
+static inline void xml__iov_add(XMLIovSink *sink, const char *data, size_t len) {
+  if (len == 0) return;
+  if (sink->len == XML_IOV_SINK_SIZE && !xml_iov_sink_flush(sink)) return;
+  sink->iov[sink->len].iov_base = (void *)data;
+  sink->iov[sink->len].iov_len = len;
+  sink->len++;
+}
+
+#define XML__IOV_ADD_LITERAL(sink, literal) xml__iov_add(sink, literal, sizeof(literal) - 1)
+
+static void xml__serialize_iov(XMLNode *node, XMLIovSink *sink) {
   if (node->tag) {
-    xml_string_append(str, "<");
-    xml_string_append(str, node->tag);
+    XML__IOV_ADD_LITERAL(sink, "<");
+    xml__iov_add(sink, node->tag, strlen(node->tag));
     // Attributes
     for (size_t i = 0; i < node->attrs->len; ++i) {
-      XMLAttr *attr = node->attrs->data[i];
-      xml_string_append(str, " ");
-      xml_string_append(str, attr->key);
-      xml_string_append(str, "=\"");
-      xml_string_append(str, attr->value);
-      xml_string_append(str, "\"");
+      XMLAttr *attr = (XMLAttr *)node->attrs->data[i];
+      XML__IOV_ADD_LITERAL(sink, " ");
+      xml__iov_add(sink, attr->key, strlen(attr->key));
+      XML__IOV_ADD_LITERAL(sink, "=\"");
+      xml__iov_add(sink, attr->value, strlen(attr->value));
+      XML__IOV_ADD_LITERAL(sink, "\"");
     }
     // Self-closing case
     if (node->children->len == 0 && !node->text) {
-      xml_string_append(str, "/>");
+      XML__IOV_ADD_LITERAL(sink, "/>");
       return;
     }
-    xml_string_append(str, ">");
+    XML__IOV_ADD_LITERAL(sink, ">");
   }
   // Text
-  if (node->text) xml_string_append(str, node->text);
+  if (node->text) xml__iov_add(sink, node->text, strlen(node->text));
   // Children
-  for (size_t i = 0; i < node->children->len; ++i) {
-    XMLNode *child = node->children->data[i];
-    xml_node_serialize(child, str);
-  }
+  for (size_t i = 0; i < node->children->len && !sink->error; ++i)
+    xml__serialize_iov((XMLNode *)node->children->data[i], sink);
   // Closing tag
   if (node->tag) {
-    xml_string_append(str, "</");
-    xml_string_append(str, node->tag);
-    xml_string_append(str, ">");
+    XML__IOV_ADD_LITERAL(sink, "</");
+    xml__iov_add(sink, node->tag, strlen(node->tag));
+    XML__IOV_ADD_LITERAL(sink, ">");
   }
 }
 
+XML_H_API bool xml_node_serialize_iov(XMLNode *node, XMLIovSink *sink) {
+  if (!node || !sink) return false;
+  xml__serialize_iov(node, sink);
+  return xml_iov_sink_flush(sink);
+}
+
+#endif // _WIN32
+
 XML_H_API void xml_node_free(XMLNode *node) {
   if (!node) return;
+  const XMLAllocator *allocator = node->allocator;
+  xml__attr_index_free(node);
+  // Nothing outside the block, free it in bulk
+  if (xml__is_pristine_block(node)) {
+    XML_FREE(allocator, node);
+    return;
+  }
   // Free the text
-  XML_FREE(node->text);
+  if (!(node->flags & XML__TEXT_BORROWED)) XML_FREE(allocator, node->text);
   // Free the attributes
   for (size_t i = 0; i < node->attrs->len; i++) {
     XMLAttr *attr = (XMLAttr *)node->attrs->data[i];
-    XML_FREE(attr->key);
-    XML_FREE(attr->value);
-    XML_FREE(attr);
+    if (!(attr->flags & XML__KEY_BORROWED)) XML_FREE(allocator, attr->key);
+    if (!(attr->flags & XML__VALUE_BORROWED)) XML_FREE(allocator, attr->value);
+    if (!(attr->flags & XML__ATTR_BORROWED)) XML_FREE(allocator, attr);
   }
-  XML_FREE(node->attrs->data);
-  XML_FREE(node->attrs);
+  if (!node->attrs->borrowed) XML_FREE(allocator, node->attrs->data);
+  if (!(node->flags & XML__LISTS_BORROWED)) XML_FREE(allocator, node->attrs);
   // Recursively free the children
   for (size_t i = 0; i < node->children->len; i++) xml_node_free((XMLNode *)node->children->data[i]);
-  XML_FREE(node->children->data);
-  XML_FREE(node->children);
+  if (!node->children->borrowed) XML_FREE(allocator, node->children->data);
+  if (!(node->flags & XML__LISTS_BORROWED)) XML_FREE(allocator, node->children);
+  xml__child_index_free(allocator, node->child_index);
   // Free the tag
-  XML_FREE(node->tag);
-  // Free the node itself
-  XML_FREE(node);
+  if (!(node->flags & XML__TAG_BORROWED)) XML_FREE(allocator, node->tag);
+  // Free the node itself. For the root of compacted tree it's the whole block.
+  if (!(node->flags & XML__NODE_BORROWED)) XML_FREE(allocator, node);
+}
+
+// ---------- Deferred destruction ---------- //
+
+#ifndef XML_NO_THREADS
+static pthread_mutex_t xml__reclaim_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t xml__reclaim_queued = PTHREAD_COND_INITIALIZER;
+static pthread_cond_t xml__reclaim_done = PTHREAD_COND_INITIALIZER;
+static XMLNode *xml__reclaim_queue = NULL; // Nodes to free linked through node->parent
+static size_t xml__reclaim_pending = 0;    // Number of nodes queued or being freed
+static bool xml__reclaim_started = false;
+static bool xml__reclaim_stopping = false; // Thread exits once the queue is empty
+static pthread_t xml__reclaim_worker;
+
+static void *xml__reclaim_thread(void *arg) {
+  (void)arg;
+  pthread_mutex_lock(&xml__reclaim_mutex);
+  for (;;) {
+    while (!xml__reclaim_queue && !xml__reclaim_stopping) pthread_cond_wait(&xml__reclaim_queued, &xml__reclaim_mutex);
+    if (!xml__reclaim_queue) break;
+    XMLNode *node = xml__reclaim_queue;
+    xml__reclaim_queue = NULL;
+    pthread_mutex_unlock(&xml__reclaim_mutex);
+    size_t freed = 0;
+    while (node) {
+      XMLNode *next = node->parent;
+      xml_node_free(node);
+      node = next;
+      freed++;
+    }
+    // Don't hold blocks of other threads while waiting for more work
+    xml_pool_flush();
+    pthread_mutex_lock(&xml__reclaim_mutex);
+    xml__reclaim_pending -= freed;
+    if (xml__reclaim_pending == 0) pthread_cond_broadcast(&xml__reclaim_done);
+  }
+  pthread_mutex_unlock(&xml__reclaim_mutex);
+  return NULL;
+}
+#endif // XML_NO_THREADS
+
+XML_H_API bool xml_node_free_async(XMLNode *node) {
+  // Queue is linked through node->parent, which would cut the node from the middle of a tree
+  if (!node || node->parent) return false;
+  // Cheap enough to do right here
+  if (xml__is_pristine_block(node)) {
+    xml_node_free(node);
+    return true;
+  }
+#ifndef XML_NO_THREADS
+  pthread_mutex_lock(&xml__reclaim_mutex);
+  // While the thread is stopping nothing new is queued, so it can't be left in the queue
+  if (!xml__reclaim_started && !xml__reclaim_stopping)
+    xml__reclaim_started = pthread_create(&xml__reclaim_worker, NULL, xml__reclaim_thread, NULL) == 0;
+  if (xml__reclaim_started && !xml__reclaim_stopping) {
+    node->parent = xml__reclaim_queue;
+    xml__reclaim_queue = node;
+    xml__reclaim_pending++;
+    pthread_cond_signal(&xml__reclaim_queued);
+    pthread_mutex_unlock(&xml__reclaim_mutex);
+    return true;
+  }
+  pthread_mutex_unlock(&xml__reclaim_mutex);
+#endif // XML_NO_THREADS
+  // No background thread, free it here
+  xml_node_free(node);
+  return true;
+}
+
+XML_H_API void xml_node_free_wait() {
+#ifndef XML_NO_THREADS
+  pthread_mutex_lock(&xml__reclaim_mutex);
+  while (xml__reclaim_pending > 0) pthread_cond_wait(&xml__reclaim_done, &xml__reclaim_mutex);
+  pthread_mutex_unlock(&xml__reclaim_mutex);
+#endif // XML_NO_THREADS
+}
+
+XML_H_API void xml_node_free_shutdown() {
+#ifndef XML_NO_THREADS
+  pthread_mutex_lock(&xml__reclaim_mutex);
+  if (!xml__reclaim_started || xml__reclaim_stopping) {
+    pthread_mutex_unlock(&xml__reclaim_mutex);
+    return;
+  }
+  xml__reclaim_stopping = true;
+  pthread_cond_signal(&xml__reclaim_queued);
+  pthread_mutex_unlock(&xml__reclaim_mutex);
+  // Thread frees everything queued before it exits
+  pthread_join(xml__reclaim_worker, NULL);
+  pthread_mutex_lock(&xml__reclaim_mutex);
+  xml__reclaim_started = false;
+  xml__reclaim_stopping = false;
+  pthread_mutex_unlock(&xml__reclaim_mutex);
+#endif // XML_NO_THREADS
+}
+
+// ---------- Compaction ---------- //
+
+// Measure the size of node records (node, lists, arrays, attributes) and strings of the subtree.
+static void xml__compact_measure(XMLNode *node, size_t *records_size, size_t *strings_size) {
+  *records_size += XML__ALIGN(sizeof(XMLNode)) + 2 * XML__ALIGN(sizeof(XMLList));
+  *records_size += XML__ALIGN((node->children->len + node->attrs->len) * sizeof(void *));
+  *records_size += node->attrs->len * XML__ALIGN(sizeof(XMLAttr));
+  if (node->tag) *strings_size += strlen(node->tag) + 1;
+  if (node->text) *strings_size += strlen(node->text) + 1;
+  for (size_t i = 0; i < node->attrs->len; i++) {
+    XMLAttr *attr = (XMLAttr *)node->attrs->data[i];
+    *strings_size += strlen(attr->key) + 1 + strlen(attr->value) + 1;
+  }
+  for (size_t i = 0; i < node->children->len; i++)
+    xml__compact_measure((XMLNode *)node->children->data[i], records_size, strings_size);
+}
+
+// Take `size` bytes from the block cursor.
+static inline void *xml__compact_take(char **cursor, size_t size) {
+  void *ptr = *cursor;
+  *cursor += XML__ALIGN(size);
+  return ptr;
+}
+
+// Copy string into the strings area of the block.
+static inline char *xml__compact_string(char **cursor, const char *str) {
+  if (!str) return NULL;
+  size_t len = strlen(str) + 1;
+  char *copy = (char *)memcpy(*cursor, str, len);
+  *cursor += len;
+  return copy;
+}
+
+// Copy subtree into the block in depth-first order.
+// Numbering is kept only if `keep_order` is true (the copy replaces the original).
+static XMLNode *xml__compact_copy(XMLNode *node, XMLNode *parent, const XMLAllocator *allocator, bool keep_order,
+                                  char **records, char **strings) {
+  XMLNode *copy = (XMLNode *)xml__compact_take(records, sizeof(XMLNode));
+  copy->allocator = allocator;
+  copy->parent = parent;
+  copy->tag_filter = node->tag_filter;
+  if (keep_order) {
+    copy->order = node->order;
+    copy->subtree_size = node->subtree_size;
+    copy->order_stamp = node->order_stamp;
+  }
+  copy->flags = XML__NODE_BORROWED | XML__TAG_BORROWED | XML__TEXT_BORROWED | XML__LISTS_BORROWED;
+  copy->attrs = (XMLList *)xml__compact_take(records, sizeof(XMLList));
+  copy->children = (XMLList *)xml__compact_take(records, sizeof(XMLList));
+  void **arrays = (void **)xml__compact_take(records, (node->children->len + node->attrs->len) * sizeof(void *));
+  copy->children->len = copy->children->size = node->children->len;
+  copy->children->data = node->children->len ? arrays : NULL;
+  copy->children->borrowed = true;
+  copy->children->allocator = allocator;
+  copy->attrs->len = copy->attrs->size = node->attrs->len;
+  copy->attrs->data = node->attrs->len ? arrays + node->children->len : NULL;
+  copy->attrs->borrowed = true;
+  copy->attrs->allocator = allocator;
+  for (size_t i = 0; i < node->attrs->len; i++) {
+    XMLAttr *attr = (XMLAttr *)xml__compact_take(records, sizeof(XMLAttr));
+    attr->flags = XML__ATTR_BORROWED | XML__KEY_BORROWED | XML__VALUE_BORROWED;
+    copy->attrs->data[i] = attr;
+  }
+  copy->tag = xml__compact_string(strings, node->tag);
+  copy->text = xml__compact_string(strings, node->text);
+  for (size_t i = 0; i < node->attrs->len; i++) {
+    XMLAttr *src = (XMLAttr *)node->attrs->data[i], *dst = (XMLAttr *)copy->attrs->data[i];
+    dst->key = xml__compact_string(strings, src->key);
+    dst->value = xml__compact_string(strings, src->value);
+  }
+  for (size_t i = 0; i < node->children->len; i++)
+    copy->children->data[i] =
+        xml__compact_copy((XMLNode *)node->children->data[i], copy, allocator, keep_order, records, strings);
+  return copy;
+}
+
+// Copy subtree into a new block owned by the returned node.
+static XMLNode *xml__compact_block(XMLNode *node, XMLNode *parent, bool keep_order) {
+  size_t records_size = 0, strings_size = 0;
+  xml__compact_measure(node, &records_size, &strings_size);
+  char *block = (char *)xml__calloc(node->allocator, 1, records_size + strings_size);
+  if (!block) return NULL;
+  char *records = block, *strings = block + records_size;
+  XMLNode *copy = xml__compact_copy(node, parent, node->allocator, keep_order, &records, &strings);
+  // Root node owns the block
+  copy->flags &= ~XML__NODE_BORROWED;
+  return copy;
+}
+
+XML_H_API XMLNode *xml_node_compact(XMLNode *node) {
+  if (!node) return NULL;
+  XMLNode *compacted = xml__compact_block(node, node->parent, true);
+  if (!compacted) return NULL;
+  // Move indexes to the relocated tree
+  compacted->attr_index = node->attr_index;
+  node->attr_index = NULL;
+  if (node->parent) {
+    xml__mark_edited(node->parent);
+    XMLList *siblings = node->parent->children;
+    for (size_t i = 0; i < siblings->len; i++)
+      if (siblings->data[i] == node) siblings->data[i] = compacted;
+  }
+  // Indexed nodes were relocated
+  XMLNode *root = node->index_root ? xml__root(compacted) : NULL;
+  if (root) {
+    xml__attr_index_set_root(compacted, root);
+    if (!xml__attr_index_rebuild(root)) xml__attr_index_free(root);
+  }
+  xml_node_free(node);
+  return compacted;
+}
+
+XML_H_API XMLNode *xml_node_clone(XMLNode *node) {
+  if (!node) return NULL;
+  return xml__compact_block(node, NULL, false);
+}
+
+// ---------- XMLDocument ---------- //
+
+XML_H_API XMLDocument *xml_document_freeze(XMLNode *root) {
+  if (!root || root->parent) return NULL;
+  XMLDocument *doc = (XMLDocument *)xml__calloc(root->allocator, 1, sizeof(XMLDocument));
+  if (!doc) return NULL;
+  // Number the tree and recompute filters before freezing so readers never update them
+  if (!root->order_stamp) xml_node_update_order(root);
+  xml_node_update_tag_filters(root);
+  doc->root = xml_node_compact(root);
+  if (!doc->root) {
+    XML_FREE(root->allocator, doc);
+    return NULL;
+  }
+  doc->refs = 1;
+  return doc;
+}
+
+XML_H_API bool xml_document_index_attr(XMLDocument *doc, const char *key) {
+  return doc && xml_node_index_attr(doc->root, key);
+}
+
+XML_H_API XMLNode *xml_document_lookup(XMLDocument *doc, const char *key, const char *value) {
+  return doc ? xml_node_lookup(doc->root, key, value) : NULL;
+}
+
+XML_H_API XMLDocument *xml_document_retain(XMLDocument *doc) {
+  if (doc) XML__ATOMIC_ADD(&doc->refs, 1);
+  return doc;
+}
+
+XML_H_API void xml_document_release(XMLDocument *doc) {
+  if (!doc || XML__ATOMIC_SUB(&doc->refs, 1) != 0) return;
+  const XMLAllocator *allocator = doc->root->allocator;
+  xml_node_free(doc->root);
+  XML_FREE(allocator, doc);
+}
+
+XML_H_API XMLDocument *xml_document_acquire(XMLDocumentSlot *slot) {
+  if (!slot) return NULL;
+  // Register as reader of the current epoch, so publisher can't retire the document before we retain it.
+  // If the epoch moved on meanwhile, publisher may not wait for that counter anymore, so register again.
+  size_t *readers;
+  for (;;) {
+    size_t epoch = XML__ATOMIC_LOAD(&slot->epoch);
+    readers = &slot->readers[epoch & 1];
+    XML__ATOMIC_ADD(readers, 1);
+    if (XML__ATOMIC_LOAD(&slot->epoch) == epoch) break;
+    XML__ATOMIC_SUB(readers, 1);
+  }
+  XMLDocument *doc = xml_document_retain(XML__ATOMIC_LOAD(&slot->current));
+  XML__ATOMIC_SUB(readers, 1);
+  return doc;
+}
+
+XML_H_API void xml_document_publish(XMLDocumentSlot *slot, XMLDocument *doc) {
+  if (!slot) return;
+  // Only one publisher at a time
+  bool expected = false;
+  while (!XML__ATOMIC_CAS(&slot->publishing, &expected, true)) {
+    expected = false;
+    XML__YIELD();
+  }
+  XMLDocument *old = (XMLDocument *)XML__ATOMIC_EXCHANGE(&slot->current, doc);
+  // Grace period: new readers register in the other epoch, wait for readers of the old one to retain what they've seen
+  size_t epoch = XML__ATOMIC_ADD(&slot->epoch, 1) - 1;
+  while (XML__ATOMIC_LOAD(&slot->readers[epoch & 1]) != 0) XML__YIELD();
+  XML__ATOMIC_STORE(&slot->publishing, false);
+  xml_document_release(old);
+}
+
+// ---------- XMLTemplate ---------- //
+
+// Add part to the template. Placeholders are added with `len` 0.
+static bool xml__template_add_part(XMLTemplate *tmpl, size_t start, size_t len) {
+  XMLTemplatePart *parts =
+      (XMLTemplatePart *)XML_REALLOC_FUNC(tmpl->parts, (tmpl->parts_len + 1) * sizeof(XMLTemplatePart));
+  if (!parts) return false;
+  tmpl->parts = parts;
+  tmpl->parts[tmpl->parts_len].start = start;
+  tmpl->parts[tmpl->parts_len].len = len;
+  tmpl->parts_len++;
+  return true;
+}
+
+// Add placeholder part. Returns false for error.
+static bool xml__template_add_name(XMLTemplate *tmpl, const char *name, size_t len) {
+  size_t idx = 0;
+  while (idx < tmpl->names_len && !(strncmp(tmpl->names[idx], name, len) == 0 && tmpl->names[idx][len] == '\0'))
+    idx++;
+  if (idx == tmpl->names_len) {
+    char *copy = xml__strndup(NULL, name, len);
+    if (!copy) return false;
+    char **names = (char **)XML_REALLOC_FUNC(tmpl->names, (tmpl->names_len + 1) * sizeof(char *));
+    if (!names) {
+      XML_FREE(NULL, copy);
+      return false;
+    }
+    tmpl->names = names;
+    tmpl->names[tmpl->names_len++] = copy;
+  }
+  return xml__template_add_part(tmpl, idx, 0);
+}
+
+XML_H_API XMLTemplate *xml_template_compile(const char *source) {
+  if (!source) return NULL;
+  XMLTemplate *tmpl = (XMLTemplate *)XML_CALLOC_FUNC(1, sizeof(XMLTemplate));
+  if (!tmpl) return NULL;
+  XMLString *text = xml_string_new();
+  size_t run_start = 0; // Start of current static run in `text`
+  bool ok = true;
+  for (size_t i = 0; ok && source[i] != '\0'; i++) {
+    char c = source[i];
+    if ((c == '{' || c == '}') && source[i + 1] == c) {
+      // Literal brace
+      xml_string_append_n(text, &c, 1);
+      i++;
+      continue;
+    }
+    if (c == '}') {
+      ok = false;
+      break;
+    }
+    if (c != '{') {
+      xml_string_append_n(text, &c, 1);
+      continue;
+    }
+    const char *name = source + i + 1;
+    size_t name_len = strcspn(name, "{}");
+    if (name_len == 0 || name[name_len] != '}') {
+      ok = false;
+      break;
+    }
+    if (text->len > run_start) ok = xml__template_add_part(tmpl, run_start, text->len - run_start);
+    if (ok) ok = xml__template_add_name(tmpl, name, name_len);
+    run_start = text->len;
+    i += name_len + 1;
+  }
+  if (ok && text->len > run_start) ok = xml__template_add_part(tmpl, run_start, text->len - run_start);
+  tmpl->static_len = text->len;
+  tmpl->text = xml_string_steal(text);
+  if (!ok) {
+    xml_template_free(tmpl);
+    return NULL;
+  }
+  return tmpl;
+}
+
+XML_H_API size_t xml_template_index(XMLTemplate *tmpl, const char *name) {
+  if (!tmpl || !name) return (size_t)-1;
+  for (size_t i = 0; i < tmpl->names_len; i++)
+    if (strcmp(tmpl->names[i], name) == 0) return i;
+  return (size_t)-1;
+}
+
+XML_H_API void xml_template_render(XMLTemplate *tmpl, const char *const *values, XMLString *str) {
+  if (!tmpl || !str) return;
+  // Values usually need no escaping, so it's enough for the whole output
+  size_t len = tmpl->static_len;
+  for (size_t i = 0; i < tmpl->parts_len; i++)
+    if (tmpl->parts[i].len == 0 && values && values[tmpl->parts[i].start])
+      len += strlen(values[tmpl->parts[i].start]);
+  xml__string_reserve(str, len);
+  for (size_t i = 0; i < tmpl->parts_len; i++) {
+    XMLTemplatePart *part = &tmpl->parts[i];
+    if (part->len) xml_string_append_n(str, tmpl->text + part->start, part->len);
+    else if (values) xml_string_append_escaped(str, values[part->start]);
+  }
+}
+
+XML_H_API void xml_template_free(XMLTemplate *tmpl) {
+  if (!tmpl) return;
+  for (size_t i = 0; i < tmpl->names_len; i++) XML_FREE(NULL, tmpl->names[i]);
+  XML_FREE(NULL, tmpl->names);
+  XML_FREE(NULL, tmpl->parts);
+  XML_FREE(NULL, tmpl->text);
+  XML_FREE(NULL, tmpl);
+}
+
+// ---------- XMLColumn ---------- //
+
+// Append value of the column at `row`. Returns false for NULL string.
+static bool xml__emit_column_value(XMLString *str, const XMLColumn *column, size_t row) {
+  switch (column->type) {
+  case XML_COLUMN_STRING: {
+    const char *value = ((const char *const *)column->data)[row];
+    if (!value) return false;
+    xml__string_append_escaped_n(str, value, strlen(value));
+    break;
+  }
+  case XML_COLUMN_INT64: xml_string_append_int64(str, ((const int64_t *)column->data)[row]); break;
+  case XML_COLUMN_UINT64: xml_string_append_uint64(str, ((const uint64_t *)column->data)[row]); break;
+  case XML_COLUMN_DOUBLE: xml_string_append_double(str, ((const double *)column->data)[row]); break;
+  case XML_COLUMN_BOOL:
+    if (((const bool *)column->data)[row]) xml_string_append_n(str, "true", 4);
+    else xml_string_append_n(str, "false", 5);
+    break;
+  }
+  return true;
+}
+
+// Check if string column has NULL at `row`.
+static inline bool xml__column_is_null(const XMLColumn *column, size_t row) {
+  return column->type == XML_COLUMN_STRING && !((const char *const *)column->data)[row];
+}
+
+XML_H_API void xml_emit_columns(XMLString *str, const char *row_tag, const XMLColumn *columns, size_t columns_len,
+                                size_t rows_len) {
+  if (!str || !row_tag || (!columns && columns_len)) return;
+  size_t tag_len = strlen(row_tag);
+  // Not on the stack, column count comes from the caller
+  size_t *name_lens = columns_len ? (size_t *)xml__calloc(str->allocator, columns_len, sizeof(size_t)) : NULL;
+  if (columns_len && !name_lens) return;
+  bool has_elements = false;
+  for (size_t c = 0; c < columns_len; c++) {
+    name_lens[c] = strlen(columns[c].name);
+    if (columns[c].element) has_elements = true;
+  }
+  for (size_t row = 0; row < rows_len; row++) {
+    xml_string_append_n(str, "<", 1);
+    xml_string_append_n(str, row_tag, tag_len);
+    // Attributes
+    for (size_t c = 0; c < columns_len; c++) {
+      if (columns[c].element || xml__column_is_null(&columns[c], row)) continue;
+      xml_string_append_n(str, " ", 1);
+      xml_string_append_n(str, columns[c].name, name_lens[c]);
+      xml_string_append_n(str, "=\"", 2);
+      xml__emit_column_value(str, &columns[c], row);
+      xml_string_append_n(str, "\"", 1);
+    }
+    if (!has_elements) {
+      xml_string_append_n(str, "/>", 2);
+      continue;
+    }
+    xml_string_append_n(str, ">", 1);
+    // Child elements
+    for (size_t c = 0; c < columns_len; c++) {
+      if (!columns[c].element || xml__column_is_null(&columns[c], row)) continue;
+      xml_string_append_n(str, "<", 1);
+      xml_string_append_n(str, columns[c].name, name_lens[c]);
+      xml_string_append_n(str, ">", 1);
+      xml__emit_column_value(str, &columns[c], row);
+      xml_string_append_n(str, "</", 2);
+      xml_string_append_n(str, columns[c].name, name_lens[c]);
+      xml_string_append_n(str, ">", 1);
+    }
+    xml_string_append_n(str, "</", 2);
+    xml_string_append_n(str, row_tag, tag_len);
+    xml_string_append_n(str, ">", 1);
+  }
+  XML_FREE(str->allocator, name_lens);
 }
 
 #endif // XML_H_IMPLEMENTATION
@@ -596,6 +4785,112 @@ XML_H_API void xml_node_free(XMLNode *node) {
 
 CHANGELOG:
 
+2.2:
+    Changed:
+        - xml_node_free() frees not edited compacted trees at once
+
+    Added:
+        - xml_string_append_n()
+        - xml_string_reserve()
+        - xml_string_clear()
+        - xml_string_reset()
+        - xml_string_acquire()
+        - xml_string_release()
+        - xml_string_append_escaped()
+        - xml_string_append_int64()
+        - xml_string_append_uint64()
+        - xml_string_append_double()
+        - xml_node_add_attr_int64()
+        - xml_node_add_attr_uint64()
+        - xml_node_add_attr_double()
+        - xml_node_set_text()
+        - xml_node_set_text_int64()
+        - xml_node_set_text_uint64()
+        - xml_node_set_text_double()
+        - Per-subtree Bloom filters of tag names to skip branches in xml_node_find_tag() and queries
+            - xml_node_update_tag_filters()
+        - Pre-order numbering of nodes for O(1) structural queries
+            - xml_node_update_order()
+            - xml_node_is_ancestor()
+            - xml_node_compare_order()
+            - xml_node_descendants_count()
+        - Hash indexes of attribute values for O(1) lookups
+            - xml_node_index_attr()
+            - xml_node_lookup()
+            - xml_document_index_attr()
+            - xml_document_lookup()
+        - Children lookup by tag name with lazily built per-node index
+            - xml_node_child_by_tag()
+            - xml_node_children_by_tag()
+        - XMLSortedIndex: children sorted by attribute value for range queries
+            - xml_node_build_sorted_index()
+            - xml_sorted_index_range()
+            - xml_sorted_index_range_str()
+            - xml_sorted_index_free()
+        - xml_node_find_text(): substring search over text of the tree
+            - xml_text_iter_free()
+        - xml_stream_match(): path matching over token stream without building a tree
+        - xml_parse_string_n()
+        - XMLQuerySet: many path queries matched in one pass
+            - xml_query_set_new()
+            - xml_query_set_add()
+            - xml_query_set_match_node()
+            - xml_query_set_match_stream()
+            - xml_query_set_free()
+        - xml_aggregate(): count, sum, min and max of values over token stream
+        - XMLQuery: query expressions compiled to bytecode
+            - xml_query_compile()
+            - xml_query_free()
+            - xml_query_eval()
+        - XMLQueryCache: memo cache of query results shared by queries with common leading steps
+            - xml_query_cache_new()
+            - xml_query_cache_clear()
+            - xml_query_cache_free()
+        - xml_node_parallel_for_each(): multi-threaded traversal with work stealing
+        - xml_map_reduce(): multi-threaded parsing, mapping and tree reduction of many documents
+        - xml_node_compact()
+        - XMLIovSink: zero-copy output with writev()
+            - xml_iov_sink_init()
+            - xml_iov_sink_flush()
+            - xml_node_serialize_iov()
+        - xml_node_clone()
+        - XMLAllocator: allocation functions with user data, stored in objects created with them
+            - xml_string_new_with_allocator()
+            - xml_list_new_with_allocator()
+            - xml_node_new_with_allocator()
+            - xml_parse_string_with_allocator()
+            - xml_parse_file_with_allocator()
+        - XMLStrMode: borrowed and transferred strings in builder functions
+            - xml_node_new_static()
+            - xml_node_new_ex()
+            - xml_node_add_attr_static()
+            - xml_node_add_attr_take()
+            - xml_node_add_attr_ex()
+        - xml_list_reserve()
+        - xml_node_reserve_attrs()
+        - xml_node_reserve_children()
+        - xml_node_add_attrs()
+        - xml_node_append_children()
+        - xml_pool_allocator(): thread-local size-class pools for nodes, attributes and short strings
+        - xml_pool_flush()
+        - XMLTemplate: precompiled XML text with placeholders
+            - xml_template_compile()
+            - xml_template_index()
+            - xml_template_render()
+            - xml_template_free()
+        - XMLColumn: columnar-to-XML bulk emitter
+            - xml_emit_columns()
+        - xml_node_free_async()
+        - xml_node_free_wait()
+        - xml_node_free_shutdown()
+        - XMLDocument: immutable reference-counted snapshots
+            - xml_document_freeze()
+            - xml_document_retain()
+            - xml_document_release()
+        - XMLDocumentSlot: lock-free publishing of document snapshots
+            - xml_document_acquire()
+            - xml_document_publish()
+
 2.1:
     Removed:
         - XML_STRDUP_FUNC (POSIX function. Replaced with xml__strdup() implementation)